@@ -0,0 +1,542 @@
+#ifndef RGB_APU_CPP
+#define RGB_APU_CPP
+
+#include <algorithm>
+#include <cstdint>
+#include "mmu.hpp"
+#include "scheduler.cpp"
+#include "util/blip_buffer.hpp"
+#include "util/perf_counters.hpp"
+#include "util/spsc_queue.hpp"
+#include "util/trace.hpp"
+
+struct StereoFrame {
+    int16_t left;
+    int16_t right;
+};
+
+// Samples on their way from the emulation thread to the audio callback
+using AudioRing = SpscQueue<StereoFrame, 8192>;
+
+// The four sound channels. Nothing runs per instruction: the APU catches
+// up to the scheduler's cycle count only when one of its registers is
+// accessed or a frame of samples is wanted. Catching up walks each
+// channel from one waveform edge to the next and hands the level changes
+// to a BlipBuffer, which does the band-limited resampling.
+class Apu {
+  public:
+    static constexpr double CLOCK_RATE = 4194304;
+
+  private:
+    enum Register : uint8_t {
+        NR10 = 0x10, NR11, NR12, NR13, NR14,
+        NR21 = 0x16, NR22, NR23, NR24,
+        NR30 = 0x1a, NR31, NR32, NR33, NR34,
+        NR41 = 0x20, NR42, NR43, NR44,
+        NR50 = 0x24, NR51, NR52,
+        WAVE_RAM = 0x30
+    };
+
+    // Length counter, volume envelope and frequency timer shared by the
+    // channels; each channel uses the parts it has
+    struct Channel {
+        bool enabled = false;
+        bool dac = false;
+        int length = 0;
+        bool length_enabled = false;
+
+        int volume = 0;
+        bool envelope_up = false;
+        int envelope_period = 0;
+        int envelope_timer = 0;
+
+        uint16_t frequency = 0;
+        // Frame clock of the next timer expiry
+        uint32_t next = 0;
+        // Duty step, wave sample index or noise LFSR
+        uint16_t phase = 0;
+
+        void clock_length() {
+            if (length_enabled && length > 0 && --length == 0) {
+                enabled = false;
+            }
+        }
+
+        void clock_envelope() {
+            if (envelope_period == 0 || --envelope_timer > 0) {
+                return;
+            }
+            envelope_timer = envelope_period;
+            if (envelope_up && volume < 15) {
+                volume++;
+            } else if (!envelope_up && volume > 0) {
+                volume--;
+            }
+        }
+
+        void load_envelope(uint8_t nrx2) {
+            volume = nrx2 >> 4;
+            envelope_up = nrx2 & 0x08;
+            envelope_period = nrx2 & 0x07;
+            envelope_timer = envelope_period;
+        }
+    };
+
+    MMU &mmu;
+    Scheduler &scheduler;
+    uint8_t *io;
+
+    Channel channels[4];
+
+    // Channel 1 frequency sweep
+    bool sweep_enabled = false;
+    int sweep_timer = 0;
+    uint16_t sweep_shadow = 0;
+
+    // Scheduler cycle synthesis has caught up to, and APU clocks since the
+    // start of the current BlipBuffer frame
+    uint64_t synced = 0;
+    uint32_t frame_clock = 0;
+
+    // 512 Hz frame sequencer for lengths, sweep and envelopes
+    static constexpr uint32_t SEQUENCER_PERIOD = 8192;
+    uint32_t sequencer_clock = SEQUENCER_PERIOD;
+    int sequencer_step = 0;
+
+    // Channel output levels last handed to the buffers
+    int levels[4] = {};
+
+    BlipBuffer left = BlipBuffer(8192);
+    BlipBuffer right = BlipBuffer(8192);
+    AudioRing ring;
+    StereoFrame samples[4096];
+    uint64_t dropped = 0;
+    // Level changes are tracked but not sent to the buffers
+    bool muted = false;
+    PerfProfiler *profiler = nullptr;
+
+    // Four channels at 15 and master volume 8 stay just inside int16
+    static constexpr float SCALE = 32767.0f / (4 * 15 * 8);
+
+    static uint32_t square_period(const Channel &channel) {
+        return (2048u - channel.frequency) * 4;
+    }
+
+    static uint32_t wave_period(const Channel &channel) {
+        return (2048u - channel.frequency) * 2;
+    }
+
+    uint32_t noise_period() const {
+        static constexpr uint32_t divisors[] = { 8, 16, 32, 48, 64, 80, 96, 112 };
+        return divisors[io[NR43] & 7] << (io[NR43] >> 4);
+    }
+
+    int output(int index) const {
+        const Channel &channel = channels[index];
+        if (!channel.enabled || !channel.dac) {
+            return 0;
+        }
+        switch (index) {
+        case 0:
+        case 1: {
+            static constexpr uint8_t duties[] = { 0x01, 0x81, 0x87, 0x7e };
+            uint8_t duty = duties[io[index == 0 ? NR11 : NR21] >> 6];
+            return ((duty >> channel.phase) & 1) ? channel.volume : 0;
+        }
+        case 2: {
+            static constexpr int shifts[] = { 4, 0, 1, 2 };
+            uint8_t byte = io[WAVE_RAM + (channel.phase >> 1)];
+            int sample = (channel.phase & 1) ? byte & 0x0f : byte >> 4;
+            return sample >> shifts[(io[NR32] >> 5) & 3];
+        }
+        default:
+            return (channel.phase & 1) ? 0 : channel.volume;
+        }
+    }
+
+    // Per-side multiplier for a channel from NR50 and NR51
+    float gain(int index, bool left_side) const {
+        int shift = left_side ? 4 : 0;
+        if (!(io[NR51] & (1 << (index + shift)))) {
+            return 0;
+        }
+        return (((io[NR50] >> shift) & 7) + 1) * SCALE;
+    }
+
+    void set_level(int index, int level, uint32_t clock) {
+        int delta = level - levels[index];
+        if (delta == 0) {
+            return;
+        }
+        levels[index] = level;
+        if (muted) {
+            return;
+        }
+        left.add_delta(clock, delta * gain(index, true));
+        right.add_delta(clock, delta * gain(index, false));
+    }
+
+    void update_levels() {
+        for (int i = 0; i < 4; i++) {
+            set_level(i, output(i), frame_clock);
+        }
+    }
+
+    // Step one channel's timer up to frame clock to, recording each change
+    // in its output
+    void run_channel(int index, uint32_t to) {
+        Channel &channel = channels[index];
+        uint32_t period = index < 2 ? square_period(channel) : index == 2 ? wave_period(channel) : noise_period();
+
+        // A silent channel only needs its timer kept in step
+        if (!channel.enabled || !channel.dac || (index != 2 && channel.volume == 0)) {
+            if (channel.next < to) {
+                channel.next += (to - channel.next + period - 1) / period * period;
+            }
+            return;
+        }
+
+        while (channel.next < to) {
+            switch (index) {
+            case 0:
+            case 1:
+                channel.phase = (channel.phase + 1) & 7;
+                break;
+            case 2:
+                channel.phase = (channel.phase + 1) & 31;
+                break;
+            default: {
+                uint16_t bit = (channel.phase ^ (channel.phase >> 1)) & 1;
+                channel.phase = static_cast<uint16_t>((channel.phase >> 1) | (bit << 14));
+                if (io[NR43] & 0x08) {
+                    channel.phase = static_cast<uint16_t>((channel.phase & ~0x40) | (bit << 6));
+                }
+                break;
+            }
+            }
+            set_level(index, output(index), channel.next);
+            channel.next += period;
+        }
+    }
+
+    // Frequency the sweep would move channel 1 to; disables the channel
+    // when that overflows
+    uint16_t sweep_target() {
+        uint16_t delta = sweep_shadow >> (io[NR10] & 7);
+        uint32_t target = (io[NR10] & 0x08) ? sweep_shadow - delta : sweep_shadow + delta;
+        if (target > 2047) {
+            channels[0].enabled = false;
+        }
+        return static_cast<uint16_t>(target);
+    }
+
+    void clock_sweep() {
+        if (--sweep_timer > 0) {
+            return;
+        }
+        int period = (io[NR10] >> 4) & 7;
+        sweep_timer = period ? period : 8;
+        if (!sweep_enabled || !period) {
+            return;
+        }
+        uint16_t target = sweep_target();
+        if (target <= 2047 && (io[NR10] & 7)) {
+            sweep_shadow = target;
+            channels[0].frequency = target;
+            sweep_target();
+        }
+    }
+
+    void step_sequencer() {
+        if (!(sequencer_step & 1)) {
+            for (Channel &channel : channels) {
+                channel.clock_length();
+            }
+        }
+        if (sequencer_step == 2 || sequencer_step == 6) {
+            clock_sweep();
+        }
+        if (sequencer_step == 7) {
+            channels[0].clock_envelope();
+            channels[1].clock_envelope();
+            channels[3].clock_envelope();
+        }
+        sequencer_step = (sequencer_step + 1) & 7;
+        update_levels();
+    }
+
+    // Synthesize up to the scheduler's current cycle. The APU runs at the
+    // same rate in double speed, so it then gets half the CPU cycles.
+    void catch_up() {
+        uint32_t clocks = static_cast<uint32_t>((scheduler.cycles() - synced) >> mmu.double_speed);
+        synced += (uint64_t) clocks << mmu.double_speed;
+        uint32_t end = frame_clock + clocks;
+        while (frame_clock < end) {
+            uint32_t until = std::min(end, frame_clock + sequencer_clock);
+            for (int i = 0; i < 4; i++) {
+                run_channel(i, until);
+            }
+            sequencer_clock -= until - frame_clock;
+            frame_clock = until;
+            if (sequencer_clock == 0) {
+                sequencer_clock = SEQUENCER_PERIOD;
+                step_sequencer();
+            }
+        }
+    }
+
+    void trigger(int index) {
+        Channel &channel = channels[index];
+        channel.enabled = channel.dac;
+        if (channel.length == 0) {
+            channel.length = index == 2 ? 256 : 64;
+        }
+        switch (index) {
+        case 0:
+        case 1:
+            channel.load_envelope(io[index == 0 ? NR12 : NR22]);
+            channel.next = frame_clock + square_period(channel);
+            break;
+        case 2:
+            channel.phase = 0;
+            channel.next = frame_clock + wave_period(channel);
+            break;
+        default:
+            channel.load_envelope(io[NR42]);
+            channel.phase = 0x7fff;
+            channel.next = frame_clock + noise_period();
+            break;
+        }
+        if (index == 0) {
+            sweep_shadow = channel.frequency;
+            int period = (io[NR10] >> 4) & 7;
+            sweep_timer = period ? period : 8;
+            sweep_enabled = period || (io[NR10] & 7);
+            if (io[NR10] & 7) {
+                sweep_target();
+            }
+        }
+    }
+
+    // NRx3/NRx4 hold the low and high frequency bits for channels 1-3
+    void write_frequency(int index, uint8_t low, uint8_t high) {
+        channels[index].frequency = static_cast<uint16_t>(low | (high & 7) << 8);
+    }
+
+    void power_off() {
+        for (uint8_t reg = NR10; reg < NR52; reg++) {
+            io[reg] = 0;
+        }
+        for (Channel &channel : channels) {
+            channel = Channel();
+        }
+        sweep_enabled = false;
+    }
+
+    uint8_t read(uint8_t reg) {
+        // Unused and write-only bits read back as 1
+        static constexpr uint8_t masks[] = {
+            0x80, 0x3f, 0x00, 0xff, 0xbf,
+            0xff, 0x3f, 0x00, 0xff, 0xbf,
+            0x7f, 0xff, 0x9f, 0xff, 0xbf,
+            0xff, 0xff, 0x00, 0x00, 0xbf,
+            0x00, 0x00, 0x70
+        };
+        if (reg == NR52) {
+            catch_up();
+            uint8_t status = 0;
+            for (int i = 0; i < 4; i++) {
+                status |= channels[i].enabled ? 1 << i : 0;
+            }
+            return static_cast<uint8_t>(io[NR52] | masks[reg - NR10] | status);
+        }
+        return reg < NR10 + sizeof(masks) ? io[reg] | masks[reg - NR10] : 0xff;
+    }
+
+    void write(uint8_t reg, uint8_t value) {
+        catch_up();
+        if (!(io[NR52] & 0x80) && reg != NR52 && reg < WAVE_RAM) {
+            return;
+        }
+
+        // Remixing for new panning or master volume is a level change on
+        // every channel at once
+        if (reg == NR50 || reg == NR51) {
+            int old_levels[4];
+            std::copy(levels, levels + 4, old_levels);
+            for (int i = 0; i < 4; i++) {
+                set_level(i, 0, frame_clock);
+            }
+            io[reg] = value;
+            for (int i = 0; i < 4; i++) {
+                set_level(i, old_levels[i], frame_clock);
+            }
+            return;
+        }
+
+        io[reg] = value;
+        switch (reg) {
+        case NR11:
+        case NR21:
+            channels[reg == NR11 ? 0 : 1].length = 64 - (value & 0x3f);
+            break;
+        case NR41:
+            channels[3].length = 64 - (value & 0x3f);
+            break;
+        case NR31:
+            channels[2].length = 256 - value;
+            break;
+        case NR12:
+        case NR22:
+        case NR42: {
+            Channel &channel = channels[reg == NR12 ? 0 : reg == NR22 ? 1 : 3];
+            channel.dac = value & 0xf8;
+            channel.enabled &= channel.dac;
+            break;
+        }
+        case NR30:
+            channels[2].dac = value & 0x80;
+            channels[2].enabled &= channels[2].dac;
+            break;
+        case NR13:
+        case NR23:
+        case NR33:
+            write_frequency((reg - NR13) / 5, value, io[reg + 1]);
+            break;
+        case NR14:
+        case NR24:
+        case NR34:
+        case NR44: {
+            int index = (reg - NR14) / 5;
+            if (index < 3) {
+                write_frequency(index, io[reg - 1], value);
+            }
+            channels[index].length_enabled = value & 0x40;
+            if (value & 0x80) {
+                trigger(index);
+            }
+            break;
+        }
+        case NR52:
+            io[NR52] = value & 0x80;
+            if (!(value & 0x80)) {
+                power_off();
+            }
+            break;
+        default:
+            break;
+        }
+        update_levels();
+    }
+
+  public:
+    Apu(MMU &_mmu, Scheduler &_scheduler) : mmu(_mmu), scheduler(_scheduler), io(_mmu.io_registers()) {
+        auto read = [](void *apu, uint8_t reg) {
+            return static_cast<Apu *>(apu)->read(reg);
+        };
+        auto write = [](void *apu, uint8_t reg, uint8_t value) {
+            static_cast<Apu *>(apu)->write(reg, value);
+        };
+        for (uint8_t reg = NR10; reg < WAVE_RAM; reg++) {
+            mmu.map_io(reg, read, write, this);
+        }
+        // Wave RAM is read while channel 3 plays, so writes sync first
+        for (uint8_t reg = WAVE_RAM; reg < WAVE_RAM + 0x10; reg++) {
+            mmu.map_io(reg, nullptr, write, this);
+        }
+        set_sample_rate(48000);
+        mmu.wb(0xff00 | NR52, 0x80);
+        mmu.wb(0xff00 | NR50, 0x77);
+        mmu.wb(0xff00 | NR51, 0xf3);
+    }
+
+    // Rate may be fractional; the pacing controller adjusts it slightly
+    // every frame
+    void set_sample_rate(double rate) {
+        left.set_rates(CLOCK_RATE, rate);
+        right.set_rates(CLOCK_RATE, rate);
+    }
+
+    // Synthesis state for save states. The sample buffers aren't part of
+    // it: a state is only loaded over frames that ran muted.
+    struct State {
+        Channel channels[4];
+        bool sweep_enabled;
+        int sweep_timer;
+        uint16_t sweep_shadow;
+        uint64_t synced;
+        uint32_t frame_clock;
+        uint32_t sequencer_clock;
+        int sequencer_step;
+        int levels[4];
+    };
+
+    void save(State &state) const {
+        std::copy(channels, channels + 4, state.channels);
+        state.sweep_enabled = sweep_enabled;
+        state.sweep_timer = sweep_timer;
+        state.sweep_shadow = sweep_shadow;
+        state.synced = synced;
+        state.frame_clock = frame_clock;
+        state.sequencer_clock = sequencer_clock;
+        state.sequencer_step = sequencer_step;
+        std::copy(levels, levels + 4, state.levels);
+    }
+
+    void load(const State &state) {
+        std::copy(state.channels, state.channels + 4, channels);
+        sweep_enabled = state.sweep_enabled;
+        sweep_timer = state.sweep_timer;
+        sweep_shadow = state.sweep_shadow;
+        synced = state.synced;
+        frame_clock = state.frame_clock;
+        sequencer_clock = state.sequencer_clock;
+        sequencer_step = state.sequencer_step;
+        std::copy(state.levels, state.levels + 4, levels);
+    }
+
+    // Run ahead without producing sound
+    void set_muted(bool value) {
+        muted = value;
+    }
+
+    // Count each frame's mix as the audio section. Catching up when a
+    // register is accessed stays with the CPU.
+    void set_profiler(PerfProfiler *value) {
+        profiler = value;
+    }
+
+    // Called once per video frame: synthesize up to now and queue the
+    // samples for the audio thread. Never blocks; samples that don't fit
+    // are dropped.
+    void end_frame() {
+        RGB_TRACE_SCOPE("audio mix");
+        PerfScope perf(profiler, PerfProfiler::AUDIO);
+        catch_up();
+        if (muted) {
+            return;
+        }
+        for (Channel &channel : channels) {
+            channel.next -= frame_clock;
+        }
+        left.end_frame(frame_clock);
+        right.end_frame(frame_clock);
+        frame_clock = 0;
+
+        size_t count = std::min(left.samples_available(), sizeof(samples) / sizeof(samples[0]));
+        left.read_samples(&samples[0].left, count, 2);
+        right.read_samples(&samples[0].right, count, 2);
+        dropped += count - ring.push(samples, count);
+    }
+
+    AudioRing &output() {
+        return ring;
+    }
+
+    // Samples lost to a full ring since power on
+    uint64_t dropped_samples() const {
+        return dropped;
+    }
+};
+
+#endif //RGB_APU_CPP
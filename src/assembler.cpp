@@ -0,0 +1,631 @@
+#ifndef RGB_ASSEMBLER_CPP
+#define RGB_ASSEMBLER_CPP
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "opcodes.cpp"
+
+// Cartridge header fields the assembler fills in; the rest are fixed for
+// a 32 KiB ROM-only cartridge with no RAM
+struct RomHeader {
+    std::string title = "RGB";
+    bool cgb = false;
+};
+
+// In-process SM83 assembler producing 32 KiB ROM images, so benchmarks
+// and tests can build their own programs. Instructions are matched
+// against the opcode table in opcodes.cpp, in its notation:
+//
+//     Assembler as;
+//     as("start:")
+//       ("  ld hl, $c000")
+//       ("loop: ld a, (hl+)    ; comments run to the end of the line")
+//       ("  jr loop");
+//     std::vector<uint8_t> rom = as.rom();
+//
+// or as.assemble(text) with the same lines. Case is ignored, labels
+// included. Numbers are decimal, $ff or 0xff hex, or %0101 binary, and
+// operands may be sums and differences of numbers and labels. Directives:
+// ORG addr, DB bytes or "text", DW words, DS count[,fill], and name EQU
+// value. Code starts at 0x150; rom() adds a NOP; JP to START (or 0x150)
+// at the entry point unless the program put something there. Errors throw
+// std::runtime_error naming the line.
+class Assembler {
+  public:
+    static constexpr uint16_t CODE_START = 0x150;
+    static constexpr size_t ROM_SIZE = 0x8000;
+
+  private:
+    enum class Field : uint8_t {
+        BYTE,       // d8, -128..255
+        WORD,       // d16/a16
+        HIGH_PAGE,  // a8: 0..0xff or 0xff00..0xffff
+        SIGNED,     // r8 as an SP offset
+        RELATIVE    // r8 as a JR target address
+    };
+
+    // One way to encode an instruction; operands are literal text or
+    // contain one lower-case placeholder
+    struct Encoding {
+        std::string mnemonic;
+        std::vector<std::string> operands;
+        uint8_t opcode;
+        bool cb;
+    };
+
+    // A field whose expression is evaluated once every label is known
+    struct Fixup {
+        uint16_t at;
+        Field field;
+        std::string expression;
+        int line;
+    };
+
+    std::vector<uint8_t> image = std::vector<uint8_t>(ROM_SIZE, 0xff);
+    std::vector<bool> written = std::vector<bool>(ROM_SIZE, false);
+    uint32_t pc = CODE_START;
+    std::map<std::string, int32_t> symbols;
+    std::vector<Fixup> fixups;
+    int line = 0;
+
+    [[noreturn]] void fail(const std::string &message, int at_line = -1) const {
+        std::ostringstream text;
+        text << "line " << (at_line < 0 ? line : at_line) << ": " << message;
+        throw std::runtime_error(text.str());
+    }
+
+    static const std::vector<Encoding> &encodings() {
+        static const std::vector<Encoding> table = [] {
+            std::vector<Encoding> all;
+            auto add = [&all](const std::string &text, uint8_t opcode, bool cb) {
+                Encoding encoding;
+                size_t space = text.find(' ');
+                encoding.mnemonic = text.substr(0, space);
+                encoding.opcode = opcode;
+                encoding.cb = cb;
+                if (space != std::string::npos) {
+                    encoding.operands = split_operands(text.substr(space + 1));
+                }
+                all.push_back(encoding);
+            };
+            for (int op = 0; op < 256; op++) {
+                // RST and STOP are encoded separately
+                const char *mnemonic = OPCODES[op].mnemonic;
+                if (mnemonic && op != 0xcb && op != 0x10 && (op & 0xc7) != 0xc7) {
+                    add(mnemonic, static_cast<uint8_t>(op), false);
+                }
+                add(cb_mnemonics()[op], static_cast<uint8_t>(op), true);
+            }
+            return all;
+        }();
+        return table;
+    }
+
+    static bool is_register(const std::string &text) {
+        static const char *const names[] = {
+            "A", "B", "C", "D", "E", "H", "L", "AF", "BC", "DE", "HL", "SP", "NZ", "Z", "NC"
+        };
+        return std::find(std::begin(names), std::end(names), text) != std::end(names);
+    }
+
+    // Split at top-level commas, keeping quoted text intact
+    static std::vector<std::string> split_operands(const std::string &text) {
+        std::vector<std::string> operands;
+        std::string current;
+        int depth = 0;
+        bool quoted = false;
+        for (char c : text) {
+            if (c == '"') {
+                quoted = !quoted;
+            } else if (!quoted && c == '(') {
+                depth++;
+            } else if (!quoted && c == ')') {
+                depth--;
+            } else if (!quoted && depth == 0 && c == ',') {
+                operands.push_back(current);
+                current.clear();
+                continue;
+            }
+            current += c;
+        }
+        operands.push_back(current);
+        return operands;
+    }
+
+    // Strip spaces and upper-case everything outside quotes
+    static std::string normalize(const std::string &text) {
+        std::string out;
+        bool quoted = false;
+        for (char c : text) {
+            if (c == '"') {
+                quoted = !quoted;
+            }
+            if (quoted || c == '"') {
+                out += c;
+            } else if (!std::isspace(static_cast<unsigned char>(c))) {
+                out += static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+            }
+        }
+        return out;
+    }
+
+    static bool is_identifier_char(char c, bool first) {
+        return std::isalpha(static_cast<unsigned char>(c)) || c == '_' || c == '.'
+            || (!first && std::isdigit(static_cast<unsigned char>(c)));
+    }
+
+    static bool is_identifier(const std::string &text) {
+        if (text.empty()) {
+            return false;
+        }
+        for (size_t i = 0; i < text.size(); i++) {
+            if (!is_identifier_char(text[i], i == 0)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Sum of terms; sets undefined instead of failing when a label is
+    // not known yet
+    int32_t evaluate(const std::string &expression, bool &undefined, int at_line = -1) const {
+        undefined = false;
+        size_t i = 0;
+        int32_t total = 0;
+        bool expect_term = true;
+        int sign = 1;
+        while (i < expression.size()) {
+            char c = expression[i];
+            if (!expect_term) {
+                if (c != '+' && c != '-') {
+                    fail("unexpected '" + expression.substr(i) + "' in expression", at_line);
+                }
+                sign = c == '-' ? -1 : 1;
+                expect_term = true;
+                i++;
+                continue;
+            }
+            if (c == '-' || c == '+') {
+                sign = c == '-' ? -sign : sign;
+                i++;
+                continue;
+            }
+
+            size_t start = i;
+            int32_t value = 0;
+            if (c == '$' || c == '%' || (c == '0' && i + 1 < expression.size() && expression[i + 1] == 'X')) {
+                int base = c == '%' ? 2 : 16;
+                i += c == '0' ? 2 : 1;
+                size_t digits = i;
+                while (i < expression.size() && std::isxdigit(static_cast<unsigned char>(expression[i]))) {
+                    int digit = std::isdigit(static_cast<unsigned char>(expression[i]))
+                        ? expression[i] - '0' : expression[i] - 'A' + 10;
+                    if (digit >= base) {
+                        break;
+                    }
+                    value = value * base + digit;
+                    i++;
+                }
+                if (i == digits) {
+                    fail("bad number '" + expression.substr(start) + "'", at_line);
+                }
+            } else if (std::isdigit(static_cast<unsigned char>(c))) {
+                while (i < expression.size() && std::isdigit(static_cast<unsigned char>(expression[i]))) {
+                    value = value * 10 + (expression[i] - '0');
+                    i++;
+                }
+            } else if (is_identifier_char(c, true)) {
+                while (i < expression.size() && is_identifier_char(expression[i], false)) {
+                    i++;
+                }
+                std::string name = expression.substr(start, i - start);
+                auto symbol = symbols.find(name);
+                if (symbol != symbols.end()) {
+                    value = symbol->second;
+                } else if (is_register(name)) {
+                    fail("register " + name + " where a value was expected", at_line);
+                } else {
+                    undefined = true;
+                }
+            } else {
+                fail("unexpected '" + expression.substr(i) + "' in expression", at_line);
+            }
+            total += sign * value;
+            sign = 1;
+            expect_term = false;
+        }
+        if (expect_term) {
+            fail("missing value", at_line);
+        }
+        return total;
+    }
+
+    // A value needed right away, by a directive
+    int32_t evaluate_now(const std::string &expression) const {
+        bool undefined;
+        int32_t value = evaluate(expression, undefined);
+        if (undefined) {
+            fail("'" + expression + "' must only use labels defined above");
+        }
+        return value;
+    }
+
+    void emit(uint8_t byte) {
+        if (pc >= ROM_SIZE) {
+            fail("program doesn't fit in 32 KiB");
+        }
+        if (written[pc]) {
+            fail("overwrites the byte at address " + std::to_string(pc));
+        }
+        image[pc] = byte;
+        written[pc] = true;
+        pc++;
+    }
+
+    void emit_field(Field field, const std::string &expression) {
+        fixups.push_back({ static_cast<uint16_t>(pc), field, expression, line });
+        emit(0);
+        if (field == Field::WORD) {
+            emit(0);
+        }
+    }
+
+    void resolve(const Fixup &fixup) {
+        bool undefined;
+        int32_t value = evaluate(fixup.expression, undefined, fixup.line);
+        if (undefined) {
+            fail("undefined label in '" + fixup.expression + "'", fixup.line);
+        }
+        auto out_of_range = [&]() {
+            fail("'" + fixup.expression + "' = " + std::to_string(value) + " is out of range", fixup.line);
+        };
+        switch (fixup.field) {
+        case Field::BYTE:
+            if (value < -128 || value > 0xff) {
+                out_of_range();
+            }
+            break;
+        case Field::WORD:
+            if (value < -0x8000 || value > 0xffff) {
+                out_of_range();
+            }
+            image[fixup.at + 1] = static_cast<uint8_t>(value >> 8);
+            break;
+        case Field::HIGH_PAGE:
+            if (value < 0 || (value > 0xff && value < 0xff00) || value > 0xffff) {
+                out_of_range();
+            }
+            break;
+        case Field::SIGNED:
+            if (value < -128 || value > 127) {
+                out_of_range();
+            }
+            break;
+        case Field::RELATIVE:
+            value -= fixup.at + 1;
+            if (value < -128 || value > 127) {
+                fail("jump to '" + fixup.expression + "' is too far for JR", fixup.line);
+            }
+            break;
+        }
+        image[fixup.at] = static_cast<uint8_t>(value);
+    }
+
+    // Placeholder in a table operand, and the field it encodes
+    static bool find_placeholder(const std::string &pattern, size_t &at, size_t &length, Field &field) {
+        static const struct {
+            const char *text;
+            Field field;
+        } placeholders[] = {
+            { "d16", Field::WORD }, { "a16", Field::WORD }, { "d8", Field::BYTE },
+            { "a8", Field::HIGH_PAGE }, { "r8", Field::SIGNED },
+        };
+        for (const auto &placeholder : placeholders) {
+            at = pattern.find(placeholder.text);
+            if (at != std::string::npos) {
+                length = std::strlen(placeholder.text);
+                field = placeholder.field;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Aliases for operands written the other common ways
+    static std::string canonical(const std::string &operand) {
+        if (operand == "(HLI)") {
+            return "(HL+)";
+        }
+        if (operand == "(HLD)") {
+            return "(HL-)";
+        }
+        if (operand == "($FF00+C)" || operand == "(0XFF00+C)") {
+            return "(C)";
+        }
+        if (operand.compare(0, 3, "SP-") == 0) {
+            return "SP+-" + operand.substr(3);
+        }
+        return operand;
+    }
+
+    // Pick the encoding whose operands match with the most literal text,
+    // then emit it
+    bool emit_instruction(const std::string &mnemonic, const std::vector<std::string> &operands) {
+        const Encoding *best = nullptr;
+        size_t best_literal = 0;
+        std::vector<std::pair<Field, std::string>> best_fields;
+        for (const Encoding &encoding : encodings()) {
+            if (encoding.mnemonic != mnemonic || encoding.operands.size() != operands.size()) {
+                continue;
+            }
+            size_t literal = 0;
+            std::vector<std::pair<Field, std::string>> fields;
+            bool matched = true;
+            for (size_t i = 0; i < operands.size() && matched; i++) {
+                const std::string &pattern = encoding.operands[i];
+                const std::string operand = canonical(operands[i]);
+                size_t at, length;
+                Field field;
+                if (!find_placeholder(pattern, at, length, field)) {
+                    matched = operand == pattern;
+                    literal += pattern.size();
+                    continue;
+                }
+                std::string prefix = pattern.substr(0, at), suffix = pattern.substr(at + length);
+                matched = operand.size() > prefix.size() + suffix.size()
+                    && operand.compare(0, prefix.size(), prefix) == 0
+                    && operand.compare(operand.size() - suffix.size(), suffix.size(), suffix) == 0;
+                std::string value = matched ? operand.substr(prefix.size(), operand.size() - prefix.size() - suffix.size()) : "";
+                // "(HL)" is never an address expression, nor "C" a value
+                matched = matched && !is_register(value);
+                if (field == Field::SIGNED && mnemonic == "JR") {
+                    field = Field::RELATIVE;
+                }
+                fields.emplace_back(field, value);
+                literal += prefix.size() + suffix.size();
+            }
+            if (matched && (!best || literal > best_literal)) {
+                best = &encoding;
+                best_literal = literal;
+                best_fields = fields;
+            }
+        }
+        if (!best) {
+            return false;
+        }
+        if (best->cb) {
+            emit(0xcb);
+        }
+        emit(best->opcode);
+        for (const auto &field : best_fields) {
+            emit_field(field.first, field.second);
+        }
+        return true;
+    }
+
+    void directive_data(const std::vector<std::string> &operands, bool words) {
+        for (const std::string &operand : operands) {
+            if (!words && operand.size() >= 2 && operand.front() == '"' && operand.back() == '"') {
+                for (size_t i = 1; i + 1 < operand.size(); i++) {
+                    emit(static_cast<uint8_t>(operand[i]));
+                }
+            } else {
+                emit_field(words ? Field::WORD : Field::BYTE, operand);
+            }
+        }
+    }
+
+    void statement(const std::string &mnemonic, std::vector<std::string> operands) {
+        bool no_operands = operands.size() == 1 && operands[0].empty();
+        if (no_operands) {
+            operands.clear();
+        }
+        if (mnemonic == "ORG" && operands.size() == 1) {
+            int32_t address = evaluate_now(operands[0]);
+            if (address < 0 || address > static_cast<int32_t>(ROM_SIZE)) {
+                fail("ORG outside the ROM");
+            }
+            pc = static_cast<uint32_t>(address);
+        } else if (mnemonic == "DB" && !operands.empty()) {
+            directive_data(operands, false);
+        } else if (mnemonic == "DW" && !operands.empty()) {
+            directive_data(operands, true);
+        } else if (mnemonic == "DS" && (operands.size() == 1 || operands.size() == 2)) {
+            int32_t count = evaluate_now(operands[0]);
+            auto fill = static_cast<uint8_t>(operands.size() == 2 ? evaluate_now(operands[1]) : 0);
+            for (int32_t i = 0; i < count; i++) {
+                emit(fill);
+            }
+        } else if (mnemonic == "RST" && operands.size() == 1) {
+            int32_t vector = evaluate_now(operands[0]);
+            if (vector < 0 || vector > 0x38 || vector % 8) {
+                fail("RST vector must be one of $00, $08 ... $38");
+            }
+            emit(static_cast<uint8_t>(0xc7 | vector));
+        } else if (mnemonic == "STOP" && operands.empty()) {
+            emit(0x10);
+            emit(0x00);
+        } else if (!emit_instruction(mnemonic, operands)) {
+            // ALU operations may leave out or spell out the A operand
+            static const char *const alu[] = { "ADD", "ADC", "SUB", "SBC", "AND", "XOR", "OR", "CP" };
+            bool is_alu = std::find(std::begin(alu), std::end(alu), mnemonic) != std::end(alu);
+            std::vector<std::string> with_a = operands, without_a = operands;
+            with_a.insert(with_a.begin(), "A");
+            if (!without_a.empty()) {
+                without_a.erase(without_a.begin());
+            }
+            bool alternative = is_alu
+                && ((operands.size() == 1 && emit_instruction(mnemonic, with_a))
+                    || (operands.size() == 2 && operands[0] == "A" && emit_instruction(mnemonic, without_a)));
+            if (!alternative) {
+                std::string text = mnemonic;
+                for (size_t i = 0; i < operands.size(); i++) {
+                    text += (i ? "," : " ") + operands[i];
+                }
+                fail("no such instruction: " + text);
+            }
+        }
+    }
+
+  public:
+    Assembler() = default;
+
+    // Assemble one line of source
+    Assembler &operator()(const std::string &source) {
+        line++;
+        std::string text = source;
+        bool quoted = false;
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] == '"') {
+                quoted = !quoted;
+            } else if (text[i] == ';' && !quoted) {
+                text.resize(i);
+                break;
+            }
+        }
+
+        // Leading label
+        size_t start = text.find_first_not_of(" \t");
+        size_t colon = text.find(':');
+        if (start != std::string::npos && colon != std::string::npos
+            && is_identifier(normalize(text.substr(start, colon - start)))) {
+            label(text.substr(start, colon - start));
+            text = text.substr(colon + 1);
+        }
+
+        std::istringstream words(text);
+        std::string mnemonic, rest;
+        if (!(words >> mnemonic)) {
+            return *this;
+        }
+        mnemonic = normalize(mnemonic);
+        std::getline(words, rest);
+
+        std::istringstream after(rest);
+        std::string second, value;
+        if (after >> second && normalize(second) == "EQU") {
+            if (!is_identifier(mnemonic) || is_register(mnemonic) || symbols.count(mnemonic)) {
+                fail("bad or repeated name '" + mnemonic + "' for EQU");
+            }
+            std::getline(after, value);
+            symbols[mnemonic] = evaluate_now(normalize(value));
+            return *this;
+        }
+
+        std::vector<std::string> operands;
+        for (const std::string &operand : split_operands(rest)) {
+            operands.push_back(normalize(operand));
+        }
+        statement(mnemonic, operands);
+        return *this;
+    }
+
+    // Assemble several lines of source
+    Assembler &assemble(const std::string &source) {
+        std::istringstream lines(source);
+        std::string text;
+        while (std::getline(lines, text)) {
+            (*this)(text);
+        }
+        return *this;
+    }
+
+    Assembler &org(uint16_t address) {
+        pc = address;
+        return *this;
+    }
+
+    // Name the current address
+    Assembler &label(const std::string &name) {
+        std::string key = normalize(name);
+        if (!is_identifier(key) || is_register(key)) {
+            fail("bad label name '" + name + "'");
+        }
+        if (symbols.count(key)) {
+            fail("label " + key + " defined twice");
+        }
+        symbols[key] = static_cast<int32_t>(pc);
+        return *this;
+    }
+
+    Assembler &db(std::initializer_list<uint8_t> bytes) {
+        for (uint8_t byte : bytes) {
+            emit(byte);
+        }
+        return *this;
+    }
+
+    // Address the next byte goes to
+    uint16_t here() const {
+        return static_cast<uint16_t>(pc);
+    }
+
+    // Value of a label or EQU; throws if undefined
+    int32_t symbol(const std::string &name) const {
+        auto found = symbols.find(normalize(name));
+        if (found == symbols.end()) {
+            throw std::runtime_error("undefined label " + name);
+        }
+        return found->second;
+    }
+
+    // Resolve every label and return the ROM with entry point, header and
+    // checksums filled in
+    std::vector<uint8_t> rom(const RomHeader &header = RomHeader()) {
+        for (const Fixup &fixup : fixups) {
+            resolve(fixup);
+        }
+        for (size_t at = 0x104; at < 0x150; at++) {
+            if (written[at]) {
+                throw std::runtime_error("code at address " + std::to_string(at) + " overlaps the cartridge header");
+            }
+        }
+
+        std::vector<uint8_t> out = image;
+        if (!std::any_of(written.begin() + 0x100, written.begin() + 0x104, [](bool b) { return b; })) {
+            auto entry = static_cast<uint16_t>(symbols.count("START") ? symbols.at("START") : CODE_START);
+            const uint8_t jump[] = { 0x00, 0xc3, static_cast<uint8_t>(entry), static_cast<uint8_t>(entry >> 8) };
+            std::copy(std::begin(jump), std::end(jump), out.begin() + 0x100);
+        }
+
+        static const uint8_t logo[48] = {
+            0xce, 0xed, 0x66, 0x66, 0xcc, 0x0d, 0x00, 0x0b, 0x03, 0x73, 0x00, 0x83,
+            0x00, 0x0c, 0x00, 0x0d, 0x00, 0x08, 0x11, 0x1f, 0x88, 0x89, 0x00, 0x0e,
+            0xdc, 0xcc, 0x6e, 0xe6, 0xdd, 0xdd, 0xd9, 0x99, 0xbb, 0xbb, 0x67, 0x63,
+            0x6e, 0x0e, 0xec, 0xcc, 0xdd, 0xdc, 0x99, 0x9f, 0xbb, 0xb9, 0x33, 0x3e,
+        };
+        std::copy(std::begin(logo), std::end(logo), out.begin() + 0x104);
+        std::fill(out.begin() + 0x134, out.begin() + 0x150, 0x00);
+        for (size_t i = 0; i < header.title.size() && i < 15; i++) {
+            out[0x134 + i] = static_cast<uint8_t>(std::toupper(static_cast<unsigned char>(header.title[i])));
+        }
+        out[0x143] = header.cgb ? 0x80 : 0x00;
+        // ROM only, 32 KiB, no RAM, non-Japanese
+        out[0x14a] = 0x01;
+
+        uint8_t header_sum = 0;
+        for (size_t at = 0x134; at < 0x14d; at++) {
+            header_sum = static_cast<uint8_t>(header_sum - out[at] - 1);
+        }
+        out[0x14d] = header_sum;
+        uint16_t global_sum = 0;
+        for (size_t at = 0; at < out.size(); at++) {
+            if (at != 0x14e && at != 0x14f) {
+                global_sum = static_cast<uint16_t>(global_sum + out[at]);
+            }
+        }
+        out[0x14e] = static_cast<uint8_t>(global_sum >> 8);
+        out[0x14f] = static_cast<uint8_t>(global_sum);
+        return out;
+    }
+};
+
+#endif //RGB_ASSEMBLER_CPP
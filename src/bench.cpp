@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "assembler.cpp"
+#include "machine.cpp"
+#include "util/bench_stats.hpp"
+
+// Headless throughput benchmarks. Each workload runs a fixed number of
+// frames on a freshly built machine, several times over, and the spread
+// across runs is reported with the means as JSON on stdout, e.g.
+//
+//   rgb_bench --frames 600 --runs 5 --filter alu > bench.json
+//
+// Built with RGB_TRACE, --trace FILE also writes a Chrome trace of the runs.
+//
+// Each workload reports the frames it actually ran. One whose CPU stopped
+// before --frames is reported on stderr and fails the run.
+//
+// Construction is outside the timed region; one untimed run warms the
+// caches and branch predictors first.
+
+namespace {
+
+using BenchClock = std::chrono::steady_clock;
+
+struct Sample {
+    double seconds;
+    uint64_t cycles;
+    uint64_t frames;
+    uint64_t instructions;
+};
+
+struct Workload {
+    const char *name;
+    const char *description;
+    std::function<Sample(int frames)> run;
+};
+
+// Register arithmetic and rotates, with one backward jump per 13
+// instructions
+const char *const ALU_PROGRAM = R"(
+loop:   add a, b
+        adc a, c
+        sub d
+        xor e
+        and h
+        or l
+        inc b
+        dec c
+        rlca
+        cp $5a
+        add hl, de
+        inc de
+        jr loop
+)";
+
+// Loads and stores across WRAM, HRAM, VRAM and the stack, with HL and DE
+// wrapped to stay inside the two WRAM banks
+const char *const MEMORY_PROGRAM = R"(
+        ld hl, $c000
+        ld de, $d000
+loop:   ld a, (hl+)
+        ld (de), a
+        inc de
+        ld (hl), a
+        ldh ($80), a
+        ldh a, ($81)
+        ld a, ($8000)
+        ld ($c800), a
+        push bc
+        pop bc
+        ld a, h
+        and $0f
+        or $c0
+        ld h, a
+        ld a, d
+        and $0f
+        or $d0
+        ld d, a
+        jr loop
+)";
+
+// Data-dependent conditional branches plus a call and return per pass
+const char *const BRANCH_PROGRAM = R"(
+loop:   inc a
+        bit 0, a
+        jr z, even
+        inc b
+even:   bit 1, a
+        jr nz, skip
+        inc c
+skip:   call sub
+        dec d
+        jp nz, loop
+        jr loop
+sub:    ret
+)";
+
+// Run a whole machine for frames, discarding the sound it makes
+Sample run_machine(const std::vector<uint8_t> &rom, int frames)
+{
+    RGB rgb(rom);
+    AudioRing &audio = rgb.audio_output();
+    static StereoFrame discard[1024];
+
+    BenchClock::time_point start = BenchClock::now();
+    uint64_t done = 0;
+    while (done < static_cast<uint64_t>(frames) && rgb.run_frame()) {
+        while (audio.pop(discard, 1024) > 0) {
+        }
+        done++;
+    }
+    std::chrono::duration<double> elapsed = BenchClock::now() - start;
+    return { elapsed.count(), rgb.cycles(), done, rgb.instructions() };
+}
+
+// The GPU alone, scrolling a random background with the window and a
+// full set of sprites on every line
+Sample run_render(int frames)
+{
+    MMU mmu(std::vector<uint8_t>(0x8000));
+    mmu.inbios = false;
+    Scheduler scheduler;
+    Z80 z80(mmu);
+    Interrupts interrupts(mmu, scheduler, z80);
+    Hdma hdma(mmu, scheduler);
+    GPU gpu(mmu, interrupts, hdma);
+
+    std::mt19937 random(41);
+    for (uint32_t addr = 0x8000; addr < 0xa000; addr++) {
+        mmu.wb(static_cast<uint16_t>(addr), static_cast<uint8_t>(random()));
+    }
+    for (uint32_t addr = 0xfe00; addr < 0xfea0; addr++) {
+        mmu.wb(static_cast<uint16_t>(addr), static_cast<uint8_t>(random()));
+    }
+    mmu.wb(0xff00 | IO_WY, 72);
+    mmu.wb(0xff00 | IO_WX, 87);
+    mmu.wb(0xff00 | IO_LCDC, 0xf3);
+
+    // Straight from one mode change to the next, as when the CPU halts
+    BenchClock::time_point start = BenchClock::now();
+    uint64_t done = 0, dots = 0;
+    while (done < static_cast<uint64_t>(frames)) {
+        auto until = static_cast<uint16_t>(gpu.cycles_to_next_mode());
+        gpu.step(until);
+        dots += until;
+        if (gpu.frame_ready) {
+            gpu.frame_ready = false;
+            done++;
+            mmu.wb(0xff00 | IO_SCX, static_cast<uint8_t>(done));
+            mmu.wb(0xff00 | IO_SCY, static_cast<uint8_t>(done >> 1));
+        }
+    }
+    std::chrono::duration<double> elapsed = BenchClock::now() - start;
+    return { elapsed.count(), dots, done, 0 };
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    int frames = 600;
+    int runs = 5;
+    std::string rom_path = RGB::DEFAULT_ROM;
+    std::string filter;
+    std::string trace_path;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--rom") == 0 && i + 1 < argc) {
+            rom_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else {
+            std::cerr << "usage: rgb_bench [--frames N] [--runs N] [--rom PATH] [--filter NAME] [--trace FILE]\n";
+            return 2;
+        }
+    }
+
+    std::vector<uint8_t> rom;
+    try {
+        rom = MMU::read_rom(rom_path);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << "; skipping the cartridge workload\n";
+    }
+
+    std::vector<Workload> workloads;
+    if (!rom.empty()) {
+        workloads.push_back({ "cartridge", "the ROM from --rom, whole machine",
+                              [&](int n) { return run_machine(rom, n); } });
+    }
+    std::vector<uint8_t> alu = Assembler().assemble(ALU_PROGRAM).rom();
+    std::vector<uint8_t> memory = Assembler().assemble(MEMORY_PROGRAM).rom();
+    std::vector<uint8_t> branch = Assembler().assemble(BRANCH_PROGRAM).rom();
+    workloads.push_back({ "alu", "register arithmetic loop, whole machine",
+                          [&](int n) { return run_machine(alu, n); } });
+    workloads.push_back({ "memory", "load/store loop over each RAM region, whole machine",
+                          [&](int n) { return run_machine(memory, n); } });
+    workloads.push_back({ "branch", "conditional branch and call loop, whole machine",
+                          [&](int n) { return run_machine(branch, n); } });
+    workloads.push_back({ "render", "scanline rendering only, background, window and sprites",
+                          run_render });
+
+    RGB_TRACE_THREAD_NAME("bench");
+    std::ostream &out = std::cout;
+    out << "{\n  \"frames\": " << frames << ",\n  \"runs\": " << runs << ",\n  \"workloads\": [";
+    bool first = true;
+    bool stopped = false;
+    for (const Workload &workload : workloads) {
+        if (!filter.empty() && std::string(workload.name).find(filter) == std::string::npos) {
+            continue;
+        }
+        workload.run(std::min(frames, 60));
+
+        std::vector<double> mhz, fps, ns_per_instruction;
+        uint64_t instructions = 0, frames_run = 0;
+        for (int run = 0; run < runs; run++) {
+            Sample sample = workload.run(frames);
+            frames_run = sample.frames;
+            mhz.push_back(sample.cycles / sample.seconds / 1e6);
+            fps.push_back(sample.frames / sample.seconds);
+            if (sample.instructions > 0) {
+                ns_per_instruction.push_back(sample.seconds * 1e9 / sample.instructions);
+            }
+            instructions = sample.instructions;
+        }
+
+        out << (first ? "\n" : ",\n") << "    {\n"
+            << "      \"name\": \"" << workload.name << "\",\n"
+            << "      \"description\": \"" << workload.description << "\",\n"
+            << "      \"frames\": " << frames_run << ",\n"
+            << "      \"instructions\": " << instructions << ",\n";
+        bench_print_stats(out, "      ", "mhz", mhz);
+        out << ",\n";
+        bench_print_stats(out, "      ", "fps", fps);
+        if (!ns_per_instruction.empty()) {
+            out << ",\n";
+            bench_print_stats(out, "      ", "ns_per_instruction", ns_per_instruction);
+        }
+        out << "\n    }";
+        first = false;
+        if (frames_run < static_cast<uint64_t>(frames)) {
+            std::cerr << workload.name << ": the CPU stopped after " << frames_run << " of " << frames
+                      << " frames; its numbers are for those frames only\n";
+            stopped = true;
+        }
+    }
+    out << "\n  ]\n}\n";
+    if (!trace_path.empty() && !trace_write(trace_path)) {
+        std::cerr << "Can't write trace " << trace_path << " (tracing needs a build with RGB_TRACE)\n";
+        return 1;
+    }
+    return stopped ? 1 : 0;
+}
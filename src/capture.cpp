@@ -0,0 +1,386 @@
+#ifndef RGB_CAPTURE_CPP
+#define RGB_CAPTURE_CPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "framebuffer.cpp"
+#include "util/spsc_queue.hpp"
+#include "util/trace.hpp"
+
+// Video capture of the palette-indexed framebuffer. DMG frames hold four
+// shades and are packed four pixels to a byte; CGB frames use a byte per
+// pixel for their 64 colours. Each frame is stored as a delta against the
+// previous one: XOR, then run-length coded, which leaves a few bytes for
+// the many frames that barely change.
+//
+// File layout, little endian:
+//   "RGBCAP\0\0", u32 version, u16 width, u16 height, u8 bits per pixel
+//   records of u8 kind, u32 payload length, payload:
+//     PALETTE  the colours of the indices from here on, u32 RGBA each
+//     KEY      the packed frame, run-length coded
+//     DELTA    packed frame XOR the previous one, run-length coded
+//     REPEAT   the previous frame again, no payload
+namespace capture {
+
+constexpr char MAGIC[8] = { 'R', 'G', 'B', 'C', 'A', 'P', 0, 0 };
+constexpr uint32_t VERSION = 1;
+enum Kind : uint8_t { PALETTE, KEY, DELTA, REPEAT };
+// A key frame now and then bounds how far a reader has to go back
+constexpr uint32_t KEY_INTERVAL = 600;
+
+inline size_t packed_size(int bits) {
+    return Framebuffer::PIXELS * bits / 8;
+}
+
+inline int color_count(int bits) {
+    return bits >= 6 ? Framebuffer::CGB_COLORS : 1 << bits;
+}
+
+// Runs of three or more equal bytes become (count + 125, byte) with the
+// count byte 128..255; anything else is (length - 1, bytes...) with the
+// length byte 0..127
+inline void rle_encode(const uint8_t *data, size_t size, std::vector<uint8_t> &out) {
+    // Offset of the open literal's length byte, if any
+    constexpr size_t NONE = ~size_t(0);
+    size_t i = 0;
+    size_t literal = NONE;
+    while (i < size) {
+        size_t run = 1;
+        while (i + run < size && run < 130 && data[i + run] == data[i]) {
+            run++;
+        }
+        if (run >= 3) {
+            out.push_back(static_cast<uint8_t>(run + 125));
+            out.push_back(data[i]);
+            i += run;
+            literal = NONE;
+            continue;
+        }
+        // Start or extend a literal; its length byte is patched when done
+        if (literal == NONE) {
+            literal = out.size();
+            out.push_back(0xff);
+        }
+        out.push_back(data[i++]);
+        size_t count = out.size() - literal - 1;
+        out[literal] = static_cast<uint8_t>(count - 1);
+        if (count == 128) {
+            literal = NONE;
+        }
+    }
+}
+
+// Returns false if the data doesn't decode to exactly size bytes
+inline bool rle_decode(const uint8_t *data, size_t length, uint8_t *out, size_t size) {
+    size_t o = 0;
+    for (size_t i = 0; i < length;) {
+        uint8_t control = data[i++];
+        if (control >= 128) {
+            size_t run = control - 125u;
+            if (i >= length || o + run > size) {
+                return false;
+            }
+            std::memset(out + o, data[i++], run);
+            o += run;
+        } else {
+            size_t count = control + 1u;
+            if (i + count > length || o + count > size) {
+                return false;
+            }
+            std::memcpy(out + o, data + i, count);
+            i += count;
+            o += count;
+        }
+    }
+    return o == size;
+}
+
+}
+
+// Takes frames on the emulation thread, where they are only packed into a
+// free slot; a writer thread codes and writes them. If the writer falls
+// behind by every slot, add() waits for it rather than drop frames.
+class FrameCapture {
+  private:
+    static constexpr size_t SLOTS = 8;
+
+    struct Slot {
+        std::vector<uint8_t> packed;
+        uint32_t colors[Framebuffer::CGB_COLORS];
+    };
+
+    std::ofstream out;
+    int bits;
+    size_t size;
+    Slot slots[SLOTS];
+    SpscQueue<uint8_t, SLOTS> free_slots;
+    SpscQueue<uint8_t, SLOTS> full_slots;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    uint64_t wake_count = 0;
+    bool closing = false;
+    std::thread writer;
+
+    // Emulation thread
+    uint64_t frames = 0;
+    uint64_t stalls = 0;
+
+    // Writer thread
+    std::vector<uint8_t> previous;
+    std::vector<uint8_t> delta;
+    std::vector<uint8_t> record;
+    uint32_t palette[Framebuffer::CGB_COLORS];
+    uint64_t written = 0;
+    std::atomic<uint64_t> bytes_written{0};
+
+    void wake() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            wake_count++;
+        }
+        changed.notify_all();
+    }
+
+    template <class T>
+    void put(const T &value) {
+        out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    void put_record(capture::Kind kind, const uint8_t *payload, size_t length) {
+        put(static_cast<uint8_t>(kind));
+        put(static_cast<uint32_t>(length));
+        out.write(reinterpret_cast<const char *>(payload), length);
+        bytes_written.fetch_add(5 + length, std::memory_order_relaxed);
+    }
+
+    void write_frame(const Slot &slot) {
+        RGB_TRACE_SCOPE("capture write");
+        int colors = capture::color_count(bits);
+        if (written == 0 || !std::equal(slot.colors, slot.colors + colors, palette)) {
+            std::copy(slot.colors, slot.colors + colors, palette);
+            put_record(capture::PALETTE, reinterpret_cast<const uint8_t *>(palette), colors * sizeof(uint32_t));
+        }
+
+        record.clear();
+        if (written % capture::KEY_INTERVAL == 0) {
+            capture::rle_encode(slot.packed.data(), size, record);
+            put_record(capture::KEY, record.data(), record.size());
+        } else if (slot.packed == previous) {
+            put_record(capture::REPEAT, nullptr, 0);
+        } else {
+            for (size_t i = 0; i < size; i++) {
+                delta[i] = slot.packed[i] ^ previous[i];
+            }
+            capture::rle_encode(delta.data(), size, record);
+            put_record(capture::DELTA, record.data(), record.size());
+        }
+        previous = slot.packed;
+        written++;
+    }
+
+    void run() {
+        RGB_TRACE_THREAD_NAME("capture");
+        for (;;) {
+            uint64_t seen;
+            bool done;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                seen = wake_count;
+                done = closing;
+            }
+            uint8_t index;
+            if (full_slots.pop(index)) {
+                write_frame(slots[index]);
+                free_slots.push(index);
+                wake();
+            } else if (done) {
+                return;
+            } else {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&] { return wake_count != seen; });
+            }
+        }
+    }
+
+    void pack(const uint8_t *indices, uint8_t *packed) const {
+        if (bits == 8) {
+            std::memcpy(packed, indices, Framebuffer::PIXELS);
+            return;
+        }
+        // Eight pixels at a time: fold the shade bits of neighbouring bytes
+        // together until each 32-bit half holds one packed byte
+        for (size_t i = 0; i < size; i += 2, indices += 8) {
+            uint64_t x;
+            std::memcpy(&x, indices, sizeof(x));
+            x &= 0x0303030303030303ull;
+            x = (x | x >> 6) & 0x000f000f000f000full;
+            x = (x | x >> 12) & 0x000000ff000000ffull;
+            packed[i] = static_cast<uint8_t>(x);
+            packed[i + 1] = static_cast<uint8_t>(x >> 32);
+        }
+    }
+
+  public:
+    // cgb selects a byte per pixel; DMG frames take two bits
+    FrameCapture(const std::string &path, bool cgb)
+        : out(path, std::ios::binary), bits(cgb ? 8 : 2), size(capture::packed_size(bits)) {
+        if (!out) {
+            throw std::runtime_error("Can't write capture " + path);
+        }
+        out.write(capture::MAGIC, sizeof(capture::MAGIC));
+        put(capture::VERSION);
+        put(static_cast<uint16_t>(Framebuffer::WIDTH));
+        put(static_cast<uint16_t>(Framebuffer::HEIGHT));
+        put(static_cast<uint8_t>(bits));
+        bytes_written = static_cast<uint64_t>(out.tellp());
+        for (uint8_t i = 0; i < SLOTS; i++) {
+            slots[i].packed.resize(size);
+            free_slots.push(i);
+        }
+        previous.resize(size);
+        delta.resize(size);
+        writer = std::thread(&FrameCapture::run, this);
+    }
+
+    ~FrameCapture() {
+        close();
+    }
+
+    // Write out the frames still queued and stop the writer
+    void close() {
+        if (!writer.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            closing = true;
+            wake_count++;
+        }
+        changed.notify_all();
+        writer.join();
+        out.flush();
+    }
+
+    FrameCapture(const FrameCapture &) = delete;
+    FrameCapture &operator=(const FrameCapture &) = delete;
+
+    void add(const Framebuffer &frame) {
+        uint8_t index;
+        if (!free_slots.pop(index)) {
+            stalls++;
+            uint64_t seen;
+            do {
+                std::unique_lock<std::mutex> guard(lock);
+                seen = wake_count;
+                changed.wait(guard, [&] { return wake_count != seen || !free_slots.empty(); });
+            } while (!free_slots.pop(index));
+        }
+        Slot &slot = slots[index];
+        pack(frame.indices(), slot.packed.data());
+        for (int i = 0; i < capture::color_count(bits); i++) {
+            slot.colors[i] = frame.color(static_cast<uint8_t>(i));
+        }
+        full_slots.push(index);
+        frames++;
+        wake();
+    }
+
+    uint64_t frames_added() const {
+        return frames;
+    }
+
+    // Frames that had to wait for the writer
+    uint64_t stalled_frames() const {
+        return stalls;
+    }
+
+    // File size so far; exact after close()
+    uint64_t bytes() const {
+        return bytes_written.load(std::memory_order_relaxed);
+    }
+};
+
+// Decodes a capture a frame at a time, as RGBA pixels
+class CaptureReader {
+  private:
+    std::ifstream in;
+    int bits = 2;
+    std::vector<uint8_t> packed;
+    std::vector<uint8_t> delta;
+    std::vector<uint8_t> payload;
+    uint32_t palette[Framebuffer::CGB_COLORS] = {};
+
+    template <class T>
+    bool get(T &value) {
+        return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof(T)));
+    }
+
+  public:
+    explicit CaptureReader(const std::string &path) : in(path, std::ios::binary) {
+        char magic[sizeof(capture::MAGIC)];
+        uint32_t version = 0;
+        uint16_t width = 0, height = 0;
+        uint8_t depth = 0;
+        in.read(magic, sizeof(magic));
+        if (!in || std::memcmp(magic, capture::MAGIC, sizeof(magic)) != 0 || !get(version)
+            || version != capture::VERSION || !get(width) || !get(height) || !get(depth)
+            || width != Framebuffer::WIDTH || height != Framebuffer::HEIGHT || (depth != 2 && depth != 8)) {
+            throw std::runtime_error("Not a capture " + path);
+        }
+        bits = depth;
+        packed.resize(capture::packed_size(bits));
+        delta.resize(packed.size());
+    }
+
+    // The next frame as 0xRRGGBBAA pixels; false at the end of the file
+    bool next(uint32_t *pixels) {
+        for (;;) {
+            uint8_t kind;
+            uint32_t length;
+            if (!get(kind) || !get(length)) {
+                return false;
+            }
+            payload.resize(length);
+            if (!in.read(reinterpret_cast<char *>(payload.data()), length)) {
+                throw std::runtime_error("Truncated capture");
+            }
+            if (kind == capture::PALETTE) {
+                size_t count = std::min<size_t>(length / sizeof(uint32_t), Framebuffer::CGB_COLORS);
+                std::memcpy(palette, payload.data(), count * sizeof(uint32_t));
+                continue;
+            }
+            if (kind == capture::KEY) {
+                if (!capture::rle_decode(payload.data(), length, packed.data(), packed.size())) {
+                    throw std::runtime_error("Corrupt key frame");
+                }
+            } else if (kind == capture::DELTA) {
+                if (!capture::rle_decode(payload.data(), length, delta.data(), delta.size())) {
+                    throw std::runtime_error("Corrupt delta frame");
+                }
+                for (size_t i = 0; i < packed.size(); i++) {
+                    packed[i] ^= delta[i];
+                }
+            } else if (kind != capture::REPEAT) {
+                throw std::runtime_error("Unknown capture record");
+            }
+            break;
+        }
+
+        for (int i = 0; i < Framebuffer::PIXELS; i++) {
+            uint8_t index = bits == 8 ? packed[i] : (packed[i / 4] >> (i % 4 * 2)) & 3;
+            pixels[i] = palette[index % Framebuffer::CGB_COLORS];
+        }
+        return true;
+    }
+};
+
+#endif //RGB_CAPTURE_CPP
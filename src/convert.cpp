@@ -0,0 +1,85 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "capture.cpp"
+
+// Offline conversion of a capture (see capture.cpp) to YUV4MPEG2, which
+// ffmpeg and most players read directly, e.g.
+//
+//   rgb_convert run.rgbc run.y4m --scale 4
+//   ffmpeg -i run.y4m -c:v libx264 run.mp4
+
+namespace {
+
+// BT.601, studio range
+void to_yuv(uint32_t rgba, uint8_t &y, uint8_t &u, uint8_t &v)
+{
+    int r = rgba >> 24, g = (rgba >> 16) & 0xff, b = (rgba >> 8) & 0xff;
+    y = static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+    u = static_cast<uint8_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+    v = static_cast<uint8_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    std::string in_path, out_path;
+    int scale = 1;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = std::max(1, std::atoi(argv[++i]));
+        } else if (argv[i][0] != '-' && in_path.empty()) {
+            in_path = argv[i];
+        } else if (argv[i][0] != '-' && out_path.empty()) {
+            out_path = argv[i];
+        } else {
+            out_path.clear();
+            break;
+        }
+    }
+    if (out_path.empty()) {
+        std::cerr << "usage: rgb_convert capture out.y4m [--scale N]\n";
+        return 2;
+    }
+
+    try {
+        CaptureReader reader(in_path);
+        std::ofstream out(out_path, std::ios::binary);
+        int width = Framebuffer::WIDTH * scale, height = Framebuffer::HEIGHT * scale;
+        // One frame per 70224 cycles of the 4194304 Hz clock, about 59.73 fps
+        out << "YUV4MPEG2 W" << width << " H" << height << " F4194304:70224 Ip A1:1 C444\n";
+
+        std::vector<uint32_t> pixels(Framebuffer::PIXELS);
+        std::vector<uint8_t> planes(static_cast<size_t>(width) * height * 3);
+        uint64_t frames = 0;
+        while (reader.next(pixels.data())) {
+            uint8_t *y_plane = planes.data();
+            uint8_t *u_plane = y_plane + width * height;
+            uint8_t *v_plane = u_plane + width * height;
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    size_t o = static_cast<size_t>(y) * width + x;
+                    to_yuv(pixels[(y / scale) * Framebuffer::WIDTH + x / scale], y_plane[o], u_plane[o], v_plane[o]);
+                }
+            }
+            out << "FRAME\n";
+            out.write(reinterpret_cast<const char *>(planes.data()), planes.size());
+            frames++;
+        }
+        if (!out) {
+            std::cerr << "Can't write " << out_path << "\n";
+            return 1;
+        }
+        std::cout << out_path << ": " << frames << " frames\n";
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
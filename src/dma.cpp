@@ -0,0 +1,141 @@
+#ifndef RGB_DMA_CPP
+#define RGB_DMA_CPP
+
+#include <algorithm>
+#include <cstdint>
+#include "mmu.hpp"
+#include "scheduler.cpp"
+
+// OAM DMA. Writing DMA copies all 160 bytes into OAM immediately; the
+// transfer time only matters for the bus conflict, which ends with a
+// scheduled event rather than anything stepped per cycle. Code that waits
+// for the transfer outside HRAM, as rom/opus5.gb does from ROM, runs the
+// bytes being transferred.
+class OamDma {
+  private:
+    MMU &mmu;
+    Scheduler &scheduler;
+
+    // One M-cycle of setup, then one byte per M-cycle
+    static constexpr uint32_t DURATION = (1 + 160) * 4;
+
+    // The byte the transfer is on, which OAM already holds: one per M-cycle
+    // after the setup, as of the start of the instruction reading it
+    uint8_t current_byte() const {
+        uint64_t start = scheduler.scheduled(Event::OAM_DMA_END) - DURATION;
+        uint64_t cycle = (scheduler.cycles() - start) / 4;
+        return mmu.oam_data()[std::min<uint64_t>(cycle ? cycle - 1 : 0, 159)];
+    }
+
+    void start(uint8_t page) {
+        mmu.io_registers()[IO_DMA] = page;
+        // A restart during a transfer reads its source like the first one
+        mmu.dma_lockout = false;
+        mmu.oam_dma(page);
+        mmu.dma_lockout = true;
+        scheduler.schedule(Event::OAM_DMA_END, scheduler.cycles() + DURATION);
+    }
+
+  public:
+    OamDma(MMU &_mmu, Scheduler &_scheduler) : mmu(_mmu), scheduler(_scheduler) {
+        mmu.map_io(IO_DMA, nullptr, [](void *dma, uint8_t, uint8_t value) {
+            static_cast<OamDma *>(dma)->start(value);
+        }, this);
+        mmu.map_dma([](void *dma) {
+            return static_cast<OamDma *>(dma)->current_byte();
+        }, this);
+        scheduler.set_handler(Event::OAM_DMA_END, [](void *dma, uint64_t) {
+            static_cast<OamDma *>(dma)->mmu.dma_lockout = false;
+        }, this);
+    }
+};
+
+// CGB VRAM DMA. A general transfer is copied as soon as HDMA5 is
+// written and the CPU is stalled for its duration; an HBlank transfer
+// copies one 16-byte block at the start of each HBlank. Either way each
+// copy is a bulk MMU::vram_dma() rather than a byte per cycle.
+class Hdma {
+  private:
+    MMU &mmu;
+    Scheduler &scheduler;
+    uint8_t *io;
+
+    uint16_t source = 0;
+    uint16_t dest = 0;
+    // Blocks left in an HBlank transfer, as HDMA5 reads them
+    uint8_t status = 0xff;
+    bool hblank_active = false;
+
+    // Each block holds the CPU for 8 single speed M-cycles
+    void stall(uint32_t blocks) {
+        scheduler.stall(blocks * (32u << mmu.double_speed));
+    }
+
+    void start(uint8_t value) {
+        if (hblank_active && !(value & 0x80)) {
+            // Writing bit 7 clear stops an HBlank transfer
+            hblank_active = false;
+            status |= 0x80;
+            return;
+        }
+
+        source = static_cast<uint16_t>((io[IO_HDMA1] << 8 | io[IO_HDMA2]) & 0xfff0);
+        dest = static_cast<uint16_t>((io[IO_HDMA3] << 8 | io[IO_HDMA4]) & 0x1ff0);
+        uint32_t blocks = (value & 0x7fu) + 1;
+        if (value & 0x80) {
+            hblank_active = true;
+            status = static_cast<uint8_t>(blocks - 1);
+        } else {
+            mmu.vram_dma(dest, source, blocks * 0x10);
+            stall(blocks);
+            status = 0xff;
+        }
+    }
+
+  public:
+    Hdma(MMU &_mmu, Scheduler &_scheduler) : mmu(_mmu), scheduler(_scheduler), io(_mmu.io_registers()) {
+        if (!mmu.cgb) {
+            return;
+        }
+        mmu.map_io(IO_HDMA5, [](void *hdma, uint8_t) {
+            return static_cast<Hdma *>(hdma)->status;
+        }, [](void *hdma, uint8_t, uint8_t value) {
+            static_cast<Hdma *>(hdma)->start(value);
+        }, this);
+        // HDMA1-4 are plain storage, read when a transfer starts
+    }
+
+    struct State {
+        uint16_t source;
+        uint16_t dest;
+        uint8_t status;
+        bool hblank_active;
+    };
+
+    void save(State &state) const {
+        state = State { source, dest, status, hblank_active };
+    }
+
+    void load(const State &state) {
+        source = state.source;
+        dest = state.dest;
+        status = state.status;
+        hblank_active = state.hblank_active;
+    }
+
+    // Called by the GPU as each visible line enters HBlank
+    void hblank() {
+        if (!hblank_active) {
+            return;
+        }
+        mmu.vram_dma(dest, source, 0x10);
+        source = static_cast<uint16_t>(source + 0x10);
+        dest = static_cast<uint16_t>(dest + 0x10);
+        stall(1);
+        if (status-- == 0) {
+            hblank_active = false;
+        }
+    }
+};
+
+#endif //RGB_DMA_CPP
@@ -0,0 +1,140 @@
+#ifndef RGB_FRAMEBUFFER_CPP
+#define RGB_FRAMEBUFFER_CPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include "util/hash.hpp"
+
+enum class PixelFormat {
+    RGBA8888,   // packed 32-bit 0xRRGGBBAA
+    RGB565,     // packed 16-bit
+    GREY8
+};
+
+constexpr int bytes_per_pixel(PixelFormat format)
+{
+    return format == PixelFormat::RGBA8888 ? 4 : format == PixelFormat::RGB565 ? 2 : 1;
+}
+
+// Heap buffer whose start is aligned to a cache line
+class AlignedBuffer {
+    std::unique_ptr<uint8_t[]> storage;
+    uint8_t *aligned;
+
+  public:
+    static constexpr size_t ALIGNMENT = 64;
+
+    explicit AlignedBuffer(size_t size) : storage(new uint8_t[size + ALIGNMENT - 1]()) {
+        auto addr = reinterpret_cast<uintptr_t>(storage.get());
+        aligned = storage.get() + ((ALIGNMENT - addr % ALIGNMENT) % ALIGNMENT);
+    }
+
+    uint8_t *data() { return aligned; }
+    const uint8_t *data() const { return aligned; }
+};
+
+// The GPU renders palette indices into this buffer; once per frame they are
+// converted through a lookup table into the output pixel format. Consumers
+// read either plane in place.
+class Framebuffer {
+  public:
+    static constexpr int WIDTH = 160;
+    static constexpr int HEIGHT = 144;
+    static constexpr int PIXELS = WIDTH * HEIGHT;
+    // Indices used by CGB rendering: 8 background then 8 object palettes
+    static constexpr int CGB_COLORS = 64;
+
+  private:
+    AlignedBuffer index_plane = AlignedBuffer(PIXELS);
+    AlignedBuffer pixel_plane = AlignedBuffer(PIXELS * 4);
+    PixelFormat pixel_format = PixelFormat::RGBA8888;
+
+    uint32_t palette[256];
+    union {
+        uint32_t rgba[256];
+        uint16_t rgb565[256];
+        uint8_t grey[256];
+    } lut;
+    bool lut_stale = true;
+    uint64_t digest = 0;
+
+    void rebuild_lut() {
+        for (int i = 0; i < 256; i++) {
+            uint32_t r = palette[i] >> 24, g = (palette[i] >> 16) & 0xff, b = (palette[i] >> 8) & 0xff;
+            switch (pixel_format) {
+            case PixelFormat::RGBA8888:
+                lut.rgba[i] = palette[i];
+                break;
+            case PixelFormat::RGB565:
+                lut.rgb565[i] = static_cast<uint16_t>((r >> 3) << 11 | (g >> 2) << 5 | (b >> 3));
+                break;
+            case PixelFormat::GREY8:
+                lut.grey[i] = static_cast<uint8_t>((r * 77 + g * 150 + b * 29) >> 8);
+                break;
+            }
+        }
+        lut_stale = false;
+    }
+
+    template <class T>
+    void convert_with(const T *table) {
+        const uint8_t *src = index_plane.data();
+        T *dst = reinterpret_cast<T *>(pixel_plane.data());
+        for (int i = 0; i < PIXELS; i++) {
+            dst[i] = table[src[i]];
+        }
+    }
+
+  public:
+    Framebuffer() {
+        // DMG shades, lightest first
+        static constexpr uint32_t shades[4] = { 0xffffffff, 0xc0c0c0ff, 0x606060ff, 0x000000ff };
+        for (int i = 0; i < 256; i++) {
+            palette[i] = shades[i & 3];
+        }
+    }
+
+    void set_format(PixelFormat format) {
+        pixel_format = format;
+        lut_stale = true;
+    }
+
+    void set_color(uint8_t index, uint32_t rgba) {
+        palette[index] = rgba;
+        lut_stale = true;
+    }
+
+    uint32_t color(uint8_t index) const { return palette[index]; }
+
+    uint8_t *line(int y) { return index_plane.data() + y * WIDTH; }
+
+    // Translate the whole index plane into the pixel plane
+    void convert() {
+        if (lut_stale) {
+            rebuild_lut();
+        }
+        switch (pixel_format) {
+        case PixelFormat::RGBA8888: convert_with(lut.rgba); break;
+        case PixelFormat::RGB565: convert_with(lut.rgb565); break;
+        case PixelFormat::GREY8: convert_with(lut.grey); break;
+        }
+    }
+
+    // Digest of the picture as indices and the colours they stand for, so
+    // it doesn't depend on the output format. Only computed on request.
+    void update_hash() {
+        digest = hash_bytes(index_plane.data(), PIXELS,
+                            hash_bytes(reinterpret_cast<const uint8_t *>(palette), sizeof(palette)));
+    }
+
+    uint64_t hash() const { return digest; }
+
+    PixelFormat format() const { return pixel_format; }
+    const uint8_t *indices() const { return index_plane.data(); }
+    const uint8_t *pixels() const { return pixel_plane.data(); }
+    int pitch() const { return WIDTH * bytes_per_pixel(pixel_format); }
+};
+
+#endif //RGB_FRAMEBUFFER_CPP
@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "machine.cpp"
+#include "util/png.hpp"
+
+// Screenshot regression without screenshots: runs ROMs with no input and
+// compares the hash of chosen frames against golden values. ROMs run in
+// parallel; only frames that don't match are written out, as PNG.
+//
+//   rgb_frametest manifest [--jobs N] [--out DIR] [--update]
+//
+// The manifest has one check per line, "rom frame hash", with the hash in
+// hex or "-" for none yet; "#" starts a comment. --update rewrites it with
+// the hashes produced now.
+
+namespace {
+
+struct Check {
+    std::string rom;
+    uint64_t frame;
+    bool has_golden;
+    uint64_t golden;
+    // Filled in by the run
+    bool ran = false;
+    uint64_t actual = 0;
+    std::string error;
+};
+
+std::string file_name(const std::string &path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// Run one ROM up to its last checked frame, hashing every frame on the way
+void run_rom(std::vector<Check *> &checks, const std::string &out_dir)
+{
+    std::sort(checks.begin(), checks.end(), [](const Check *a, const Check *b) { return a->frame < b->frame; });
+    std::unique_ptr<RGB> rgb;
+    try {
+        rgb.reset(new RGB(MMU::read_rom(checks.front()->rom)));
+    } catch (const std::exception &e) {
+        for (Check *check : checks) {
+            check->error = e.what();
+        }
+        return;
+    }
+    rgb->set_frame_hashing(true);
+
+    for (Check *check : checks) {
+        while (rgb->frames() < check->frame && rgb->run_frame()) {
+        }
+        if (rgb->frames() < check->frame) {
+            check->error = "CPU stopped after frame " + std::to_string(rgb->frames());
+            continue;
+        }
+        const Framebuffer &frame = rgb->frame();
+        check->ran = true;
+        check->actual = frame.hash();
+        if (check->has_golden && check->actual != check->golden && !out_dir.empty()) {
+            std::string path = out_dir + "/" + file_name(check->rom) + "-" + std::to_string(check->frame) + ".png";
+            if (!write_png(path, reinterpret_cast<const uint32_t *>(frame.pixels()), Framebuffer::WIDTH,
+                           Framebuffer::HEIGHT)) {
+                check->error = "can't write " + path;
+            }
+        }
+    }
+}
+
+std::string hex(uint64_t value)
+{
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", (unsigned long long) value);
+    return text;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    std::string manifest_path;
+    std::string out_dir = ".";
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    bool update = false;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+        } else if (std::strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_dir = argv[++i];
+        } else if (std::strcmp(argv[i], "--update") == 0) {
+            update = true;
+        } else if (argv[i][0] != '-' && manifest_path.empty()) {
+            manifest_path = argv[i];
+        } else {
+            manifest_path.clear();
+            break;
+        }
+    }
+    if (manifest_path.empty()) {
+        std::cerr << "usage: rgb_frametest manifest [--jobs N] [--out DIR] [--update]\n";
+        return 2;
+    }
+
+    // Lines are kept as read so --update only touches the hashes
+    std::ifstream manifest(manifest_path);
+    if (!manifest) {
+        std::cerr << "Can't read manifest " << manifest_path << "\n";
+        return 1;
+    }
+    std::vector<std::string> lines;
+    std::vector<Check> checks;
+    std::vector<size_t> check_lines;
+    for (std::string line; std::getline(manifest, line);) {
+        lines.push_back(line);
+        std::string content = line.substr(0, line.find('#'));
+        std::istringstream fields(content);
+        Check check;
+        std::string hash;
+        if (!(fields >> check.rom)) {
+            continue;
+        }
+        if (!(fields >> check.frame >> hash)) {
+            std::cerr << manifest_path << ":" << lines.size() << ": expected \"rom frame hash\"\n";
+            return 1;
+        }
+        check.has_golden = hash != "-";
+        check.golden = check.has_golden ? std::strtoull(hash.c_str(), nullptr, 16) : 0;
+        checks.push_back(check);
+        check_lines.push_back(lines.size() - 1);
+    }
+
+    // One job per ROM, however many frames it checks
+    std::map<std::string, std::vector<Check *>> by_rom;
+    for (Check &check : checks) {
+        by_rom[check.rom].push_back(&check);
+    }
+    std::vector<std::vector<Check *> *> roms;
+    for (auto &entry : by_rom) {
+        roms.push_back(&entry.second);
+    }
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < std::min<size_t>(jobs, roms.size()); i++) {
+        workers.emplace_back([&] {
+            for (size_t job; (job = next.fetch_add(1)) < roms.size();) {
+                run_rom(*roms[job], update ? std::string() : out_dir);
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+
+    size_t mismatches = 0, errors = 0, missing = 0;
+    for (const Check &check : checks) {
+        std::string name = check.rom + " frame " + std::to_string(check.frame);
+        if (!check.error.empty()) {
+            errors++;
+            std::cout << name << ": " << check.error << "\n";
+        } else if (!check.has_golden) {
+            missing++;
+            if (!update) {
+                std::cout << name << ": no golden hash, got " << hex(check.actual) << "\n";
+            }
+        } else if (check.actual != check.golden) {
+            mismatches++;
+            std::cout << name << ": " << hex(check.actual) << " instead of " << hex(check.golden) << "\n";
+        }
+    }
+
+    if (update) {
+        for (size_t i = 0; i < checks.size(); i++) {
+            if (checks[i].ran) {
+                std::string &line = lines[check_lines[i]];
+                size_t comment = line.find('#');
+                line = checks[i].rom + " " + std::to_string(checks[i].frame) + " " + hex(checks[i].actual)
+                    + (comment == std::string::npos ? "" : "   " + line.substr(comment));
+            }
+        }
+        std::ofstream out(manifest_path);
+        for (const std::string &line : lines) {
+            out << line << "\n";
+        }
+        if (!out) {
+            std::cerr << "Can't write manifest " << manifest_path << "\n";
+            return 1;
+        }
+        std::cout << "updated " << checks.size() - errors << " hashes in " << manifest_path << "\n";
+        return errors ? 1 : 0;
+    }
+
+    std::cout << checks.size() << " checks in " << roms.size() << " ROMs: " << mismatches << " mismatched, "
+              << errors << " failed, " << missing << " without golden hashes\n";
+    return mismatches || errors ? 1 : 0;
+}
@@ -1,12 +1,14 @@
+#include <algorithm>
+#include <memory>
 #include "mmu.hpp"
-#include <SDL/SDL.h>
-
-void putpixel(SDL_Surface *surface, int x, int y, Uint32 pixel)
-{
-    int bpp = surface->format->BytesPerPixel;
-    Uint8 *p = (Uint8 *)surface->pixels + y * surface->pitch + x * bpp;
-    *p = pixel;
-}
+#include "dma.cpp"
+#include "interrupts.cpp"
+#include "framebuffer.cpp"
+#include "rasterizer.cpp"
+#include "render_pipeline.cpp"
+#include "util/hash.hpp"
+#include "util/perf_counters.hpp"
+#include "util/trace.hpp"
 
 enum class GPUMode {
     OAM_READ,
@@ -18,161 +20,385 @@ enum class GPUMode {
 class GPU {
   private:
     MMU &mmu;
-    SDL_Surface *screen;
+    Interrupts &interrupts;
+    Hdma &hdma;
     GPUMode mode;
     uint8_t line;
     int mode_clock;
 
-    uint8_t scroll_x;
-    uint8_t scroll_y;
+    // LCDC, SCY, SCX, BGP and the other plain registers live in the MMU's
+    // I/O register file; only LY and STAT are served through handlers
+    uint8_t *io;
+
+    // Window rows drawn so far this frame; the window only advances on
+    // lines where it is visible
+    uint8_t window_line;
+    bool lcd_on;
+
+    // Level of the combined STAT interrupt sources; the interrupt is
+    // requested on its rising edge only
+    bool stat_line;
+
+    // Filled by the OAM scan at the start of each line
+    uint8_t sprite_count;
+    Sprite sprites[ScanlineRegs::MAX_SPRITES];
+
+    // CGB palette RAM as last converted to colours
+    uint32_t palette_version;
+    uint32_t colors[Framebuffer::CGB_COLORS];
+
+    Framebuffer framebuffer;
+    Rasterizer rasterizer;
+    std::unique_ptr<RenderPipeline> pipeline;
+    bool rendering = true;
+    bool hashing = false;
+    PerfProfiler *profiler = nullptr;
 
   public:
-    static constexpr uint8_t WIDTH = 160;
-    static constexpr uint8_t HEIGHT = 144;
+    // Set when a frame has been completed, for the caller to clear
+    bool frame_ready;
 
-    GPU(MMU &_mmu) : mmu(_mmu) {
+    static constexpr uint8_t WIDTH = Framebuffer::WIDTH;
+    static constexpr uint8_t HEIGHT = Framebuffer::HEIGHT;
+
+    GPU(MMU &_mmu, Interrupts &_interrupts, Hdma &_hdma)
+        : mmu(_mmu), interrupts(_interrupts), hdma(_hdma), io(_mmu.io_registers()) {
+        mmu.map_io(IO_LY, [](void *gpu, uint8_t) {
+            return static_cast<GPU *>(gpu)->line;
+        }, [](void *, uint8_t, uint8_t) {
+            // read-only
+        }, this);
+        mmu.map_io(IO_STAT, [](void *gpu, uint8_t) {
+            return static_cast<GPU *>(gpu)->read_stat();
+        }, [](void *gpu, uint8_t, uint8_t value) {
+            // Only the interrupt selects are writable
+            static_cast<GPU *>(gpu)->io[IO_STAT] = value & 0x78;
+            static_cast<GPU *>(gpu)->update_stat();
+        }, this);
+        mmu.map_io(IO_LYC, nullptr, [](void *gpu, uint8_t, uint8_t value) {
+            static_cast<GPU *>(gpu)->io[IO_LYC] = value;
+            static_cast<GPU *>(gpu)->update_stat();
+        }, this);
         reset();
     }
 
     void reset() {
-        scroll_x = 0;
-        scroll_y = 0;
+        // State first: the LYC write below already evaluates STAT
+        sprite_count = 0;
+        window_line = 0;
+        lcd_on = true;
+        stat_line = false;
+        palette_version = mmu.palette_version - 1;
+        frame_ready = false;
         mode = GPUMode::OAM_READ;
         line = 0;
         mode_clock = 0;
+        mmu.wb(0xff00 | IO_LCDC, 0x91);
+        mmu.wb(0xff00 | IO_SCY, 0);
+        mmu.wb(0xff00 | IO_SCX, 0);
+        mmu.wb(0xff00 | IO_LYC, 0);
+        mmu.wb(0xff00 | IO_BGP, 0xe4);
+        mmu.wb(0xff00 | IO_OBP0, 0xff);
+        mmu.wb(0xff00 | IO_OBP1, 0xff);
+        mmu.wb(0xff00 | IO_WY, 0);
+        mmu.wb(0xff00 | IO_WX, 0);
     }
 
-    void render_scan() {
-        // bgmap ? 0x1c00 : 0x1800
-        uint16_t mapoffs = 0x1800;
-        mapoffs += ((line + scroll_y) & 0xff) >> 3;
-
-        uint8_t lineoffs = scroll_x >> 3;
-
-        // where in the tile to read
-        auto y = static_cast<uint16_t>((line + scroll_y) & 7);
-        auto x = static_cast<uint16_t>(scroll_x & 7);
-
-        uint8_t lower = mmu.rb(static_cast<uint16_t>(0x8000) + mapoffs + lineoffs);
-        uint8_t upper = mmu.rb(static_cast<uint16_t>(0x8001) + mapoffs + lineoffs);
-        //	if (_bgtile == 1 && tile < 128) tile += 256;
-        for (int i = 0; i < WIDTH; i++) {
-            uint32_t color = 0;
-            color |= (upper >> (x-1)) & 2;
-            color |= (lower >> x) & 1;
-            switch (color) {
-            case 0:
-                color = 0;
-                break;
-            case 1:
-                color = 0xff606060;
-                break;
-            case 2:
-                color = 0xffc0c0c0;
-                break;
-            case 3:
-                color = 0xffffffff;
-                break;
-            default:
-                throw std::out_of_range(std::string("Unexpected color bits: ") + std::to_string(color));
-            }
+    // Timing and per-line state for save states. Registers are saved with
+    // the MMU; the framebuffer is not saved, as the next frame redraws it.
+    struct State {
+        GPUMode mode;
+        uint8_t line;
+        int mode_clock;
+        uint8_t window_line;
+        bool lcd_on;
+        bool stat_line;
+        bool frame_ready;
+        uint8_t sprite_count;
+        Sprite sprites[ScanlineRegs::MAX_SPRITES];
+    };
 
-            putpixel(screen, i, line, color);
+    void save(State &state) const {
+        state.mode = mode;
+        state.line = line;
+        state.mode_clock = mode_clock;
+        state.window_line = window_line;
+        state.lcd_on = lcd_on;
+        state.stat_line = stat_line;
+        state.frame_ready = frame_ready;
+        state.sprite_count = sprite_count;
+        std::copy(sprites, sprites + ScanlineRegs::MAX_SPRITES, state.sprites);
+    }
 
-            x++;
-            if (x == 8) {
-                x = 0;
-                // read next tile
-            }
+    void load(const State &state) {
+        mode = state.mode;
+        line = state.line;
+        mode_clock = state.mode_clock;
+        window_line = state.window_line;
+        lcd_on = state.lcd_on;
+        stat_line = state.stat_line;
+        frame_ready = state.frame_ready;
+        sprite_count = state.sprite_count;
+        std::copy(state.sprites, state.sprites + ScanlineRegs::MAX_SPRITES, sprites);
+    }
+
+    // Registers are hashed with the rest of the I/O page by the MMU
+    uint64_t hash() const {
+        uint64_t state = (uint64_t) mode | (uint64_t) line << 8 | (uint64_t) window_line << 16
+            | (uint64_t) lcd_on << 24 | (uint64_t) (uint32_t) mode_clock << 32;
+        return hash_mix(state);
+    }
+
+    uint8_t read_stat() const {
+        // STAT numbers the modes HBlank, VBlank, OAM, VRAM
+        static constexpr uint8_t mode_bits[] = { 2, 3, 0, 1 };
+        uint8_t coincidence = line == io[IO_LYC] ? 0x04 : 0;
+        return 0x80 | io[IO_STAT] | coincidence | (lcd_on ? mode_bits[static_cast<int>(mode)] : 0);
+    }
+
+    // Re-evaluate the STAT interrupt sources after a mode, line or select
+    // change
+    void update_stat() {
+        uint8_t stat = read_stat();
+        bool level = lcd_on && (((stat & 0x04) && (stat & 0x40))
+                                || (mode == GPUMode::HBLANK && (stat & 0x08))
+                                || (mode == GPUMode::VBLANK && (stat & 0x10))
+                                || (mode == GPUMode::OAM_READ && (stat & 0x20)));
+        if (level && !stat_line) {
+            interrupts.request(INT_STAT);
         }
+        stat_line = level;
     }
 
-    void render_image() {
-        // TODO
+    // Cycles until step() next changes mode or line, so a halted CPU can
+    // skip straight to it
+    int cycles_to_next_mode() const {
+        if (!lcd_on) {
+            return 70224 - mode_clock;
+        }
+        static constexpr int lengths[] = { 80, 172, 204, 456 };
+        return std::max(lengths[static_cast<int>(mode)] - mode_clock, 1);
     }
 
-    void step(uint16_t reg_t) {
-        mode_clock += reg_t;
+    // Rasterize on a separate thread. Frames are then presented one frame
+    // later than in synchronous mode, with identical contents.
+    void set_pipelined(bool enabled) {
+        if (enabled && !pipeline) {
+            pipeline.reset(new RenderPipeline(mmu));
+        } else if (!enabled && pipeline) {
+            pipeline.reset();
+            std::fill(std::begin(mmu.dirty_tiles), std::end(mmu.dirty_tiles), ~0ull);
+        }
+        // The new renderer needs the palette again
+        palette_version = mmu.palette_version - 1;
+    }
 
-        switch (mode) {
-        case GPUMode::OAM_READ:
-            if (mode_clock >= 80) {
-                mode_clock = 0;
-                mode = GPUMode::VRAM_READ;
-            }
-            break;
-        case GPUMode::VRAM_READ:
-            if (mode_clock >= 172) {
-                mode_clock = 0;
-                mode = GPUMode::HBLANK;
+    // Headless runs that only need the machine state can skip drawing.
+    // Timing, interrupts and the window line counter are unaffected, and
+    // tiles stay marked dirty for when drawing resumes.
+    void set_rendering(bool enabled) {
+        rendering = enabled;
+    }
 
-                render_scan();
-            }
-            break;
-        case GPUMode::HBLANK:
-            if (mode_clock >= 204) {
-                mode_clock = 0;
-                line++;
+    // Hash each frame as it is completed, read back with frame().hash()
+    void set_frame_hashing(bool enabled) {
+        hashing = enabled;
+    }
 
-                if (line == 143) {
-                    mode = GPUMode::VBLANK;
-                    render_image();
-                } else {
-                    mode = GPUMode::OAM_READ;
-                }
-            }
-            break;
-        case GPUMode::VBLANK:
-            if (mode_clock >= 456) {
-                mode_clock = 0;
-                line++;
+    // Count drawing as the render section; with the pipeline that is only
+    // handing lines over, as the drawing is on another thread
+    void set_profiler(PerfProfiler *value) {
+        profiler = value;
+    }
+
+    const Framebuffer &frame() {
+        return pipeline ? pipeline->latest_frame() : framebuffer;
+    }
+
+    ScanlineRegs scanline_regs() const {
+        ScanlineRegs regs = {
+            line, io[IO_SCX], io[IO_SCY], io[IO_LCDC], io[IO_BGP], io[IO_OBP0], io[IO_OBP1],
+            io[IO_WX], io[IO_WY], window_line, mmu.vram_version, mmu.cgb, sprite_count
+        };
+        std::copy(sprites, sprites + sprite_count, regs.sprites);
+        return regs;
+    }
+
+    // Mode 2: pick the first ten sprites in OAM that cover this line and
+    // order them by priority (lower X first, then lower OAM index; on CGB
+    // OAM order alone)
+    void scan_oam() {
+        const uint8_t *oam = mmu.oam_data();
+        int height = (io[IO_LCDC] & 0x04) ? 16 : 8;
+        sprite_count = 0;
+        for (int i = 0; i < 40 && sprite_count < ScanlineRegs::MAX_SPRITES; i++) {
+            const uint8_t *entry = oam + i * 4;
+            int top = entry[0] - 16;
+            if (line < top || line >= top + height) {
+                continue;
             }
 
-            if (line > 153) {
-                mode = GPUMode::OAM_READ;
-                line = 0;
+            Sprite sprite = { entry[0], entry[1], entry[2], entry[3] };
+            int j = sprite_count++;
+            for (; j > 0 && !mmu.cgb && sprites[j - 1].x > sprite.x; j--) {
+                sprites[j] = sprites[j - 1];
             }
+            sprites[j] = sprite;
         }
     }
 
-    bool init() {
-        if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-            return false;
+    void render_scan() {
+        if (rendering) {
+            RGB_TRACE_SCOPE("scanline");
+            PerfScope perf(profiler, PerfProfiler::RENDER);
+            if (pipeline) {
+                pipeline->push_line(scanline_regs());
+            } else {
+                rasterizer.update_tiles(mmu.vram(), mmu.dirty_tiles);
+                rasterizer.render_line(scanline_regs(), mmu.vram(), framebuffer);
+            }
+        }
+
+        // On CGB LCDC bit 0 doesn't hide the window, as in render_line_cgb
+        uint8_t window_enabled = mmu.cgb ? 0xa0 : 0xa1;
+        if ((io[IO_LCDC] & window_enabled) == window_enabled && line >= io[IO_WY] && io[IO_WX] < WIDTH + 7) {
+            window_line++;
         }
+    }
 
-        if ((screen = SDL_SetVideoMode(WIDTH, HEIGHT, 0, 0)) == NULL) {
+    // Convert CGB palette RAM to colours if it changed. Returns false when
+    // the colours are unchanged.
+    bool update_colors() {
+        if (!mmu.cgb || palette_version == mmu.palette_version) {
             return false;
         }
+        palette_version = mmu.palette_version;
+        const uint8_t *cram = mmu.palette_data();
+        for (int i = 0; i < Framebuffer::CGB_COLORS; i++) {
+            uint32_t rgb555 = cram[i * 2] | cram[i * 2 + 1] << 8;
+            uint32_t r = rgb555 & 0x1f, g = (rgb555 >> 5) & 0x1f, b = (rgb555 >> 10) & 0x1f;
+            // Widen each 5-bit channel to 8 bits
+            r = r << 3 | r >> 2;
+            g = g << 3 | g >> 2;
+            b = b << 3 | b >> 2;
+            colors[i] = r << 24 | g << 16 | b << 8 | 0xff;
+        }
+        return true;
+    }
 
-        SDL_Event event;
-        bool running = true;
-        while (running)
-        {
-            if (SDL_WaitEvent(&event)) {
-                switch (event.type) {
-                case SDL_QUIT:
-                    running = false;
-                    break;
-                default:
-                    break;
+    // Palettes are applied once per frame, as the frame is converted
+    void render_image() {
+        frame_ready = true;
+        if (!rendering) {
+            return;
+        }
+        RGB_TRACE_SCOPE("convert frame");
+        PerfScope perf(profiler, PerfProfiler::RENDER);
+        bool recolor = update_colors();
+        if (pipeline) {
+            pipeline->end_frame(recolor ? colors : nullptr, hashing);
+        } else {
+            if (recolor) {
+                for (int i = 0; i < Framebuffer::CGB_COLORS; i++) {
+                    framebuffer.set_color(static_cast<uint8_t>(i), colors[i]);
                 }
             }
-            SDL_Surface *bitmap = SDL_CreateRGBSurface(0, WIDTH, HEIGHT, 32, 0, 0, 0, 0);
-            draw(bitmap);
-            SDL_BlitSurface(bitmap, NULL, screen, NULL);
-            SDL_UpdateRect(screen, 0, 0, WIDTH, HEIGHT);
+            framebuffer.convert();
+            if (hashing) {
+                framebuffer.update_hash();
+            }
         }
+    }
 
-        return true;
+    // With the LCD off nothing is drawn, but blank frames are still
+    // produced at the normal rate so presentation keeps its pace
+    void step_lcd_off() {
+        if (lcd_on) {
+            lcd_on = false;
+            line = 0;
+            mode = GPUMode::HBLANK;
+            stat_line = false;
+        }
+        if (mode_clock >= 70224) {
+            mode_clock -= 70224;
+            for (line = 0; line < HEIGHT; line++) {
+                render_scan();
+            }
+            line = 0;
+            render_image();
+        }
     }
 
-    void draw(SDL_Surface *surface) {
-        SDL_LockSurface(surface);
-        for (int x = 0; x < WIDTH; x++) {
-            for (int y = 0; y < HEIGHT; y++) {
-                putpixel(surface, x, y, 0xff0000ff);
+    void step(uint16_t reg_t) {
+        mode_clock += reg_t;
+
+        if (!(io[IO_LCDC] & 0x80)) {
+            step_lcd_off();
+            return;
+        } else if (!lcd_on) {
+            lcd_on = true;
+            line = 0;
+            mode_clock = 0;
+            window_line = 0;
+            mode = GPUMode::OAM_READ;
+            update_stat();
+        }
+
+        // A general HDMA stalls the CPU for up to thousands of dots, which
+        // then arrive in one step and can span several modes
+        for (;;) {
+            switch (mode) {
+            case GPUMode::OAM_READ:
+                if (mode_clock < 80) {
+                    return;
+                }
+                mode_clock -= 80;
+                mode = GPUMode::VRAM_READ;
+                scan_oam();
+                update_stat();
+                break;
+            case GPUMode::VRAM_READ:
+                if (mode_clock < 172) {
+                    return;
+                }
+                mode_clock -= 172;
+                mode = GPUMode::HBLANK;
+
+                render_scan();
+                hdma.hblank();
+                update_stat();
+                break;
+            case GPUMode::HBLANK:
+                if (mode_clock < 204) {
+                    return;
+                }
+                mode_clock -= 204;
+                line++;
+
+                if (line == HEIGHT) {
+                    mode = GPUMode::VBLANK;
+                    interrupts.request(INT_VBLANK);
+                    render_image();
+                } else {
+                    mode = GPUMode::OAM_READ;
+                }
+                update_stat();
+                break;
+            case GPUMode::VBLANK:
+                if (mode_clock < 456) {
+                    return;
+                }
+                mode_clock -= 456;
+                line++;
+
+                if (line > 153) {
+                    mode = GPUMode::OAM_READ;
+                    line = 0;
+                    window_line = 0;
+                }
+                update_stat();
+                break;
             }
         }
-        SDL_UnlockSurface(surface);
     }
 };
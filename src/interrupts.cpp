@@ -0,0 +1,101 @@
+#ifndef RGB_INTERRUPTS_CPP
+#define RGB_INTERRUPTS_CPP
+
+#include <cstdint>
+#include "mmu.hpp"
+#include "scheduler.cpp"
+#include "z80.cpp"
+
+// IF/IE bits, in priority order
+enum Interrupt : uint8_t {
+    INT_VBLANK = 0x01,
+    INT_STAT = 0x02,
+    INT_TIMER = 0x04,
+    INT_SERIAL = 0x08,
+    INT_JOYPAD = 0x10
+};
+
+// IE/IF interrupt controller. Pending interrupts are only re-evaluated
+// when something that affects them changes: an IE or IF write, a request
+// from a component, or EI/RETI/HALT. If one can be taken, an INTERRUPT
+// event is scheduled for the current cycle, so the run loop's existing
+// scheduler check is the only per-instruction cost.
+class Interrupts {
+  private:
+    MMU &mmu;
+    Scheduler &scheduler;
+    Z80 &z80;
+    uint8_t *io;
+    uint8_t enabled;
+
+    uint8_t pending() const {
+        return enabled & io[IO_IF] & 0x1f;
+    }
+
+    void update() {
+        if (!pending()) {
+            return;
+        }
+        // Any pending interrupt ends HALT, even with IME off
+        z80.halt = false;
+        if (z80.reg.ime) {
+            scheduler.schedule(Event::INTERRUPT, scheduler.cycles());
+        }
+    }
+
+    // Take the highest priority pending interrupt, if still allowed
+    void service() {
+        uint8_t ready = pending();
+        if (!ready || !z80.reg.ime) {
+            return;
+        }
+        int bit = __builtin_ctz(ready);
+        z80.interrupt(static_cast<uint16_t>(0x40 + bit * 8));
+        mmu.write_io(IO_IF, io[IO_IF] & ~(1u << bit));
+        // Dispatch takes five M-cycles
+        scheduler.stall(20);
+    }
+
+  public:
+    Interrupts(MMU &_mmu, Scheduler &_scheduler, Z80 &_z80)
+        : mmu(_mmu), scheduler(_scheduler), z80(_z80), io(_mmu.io_registers()), enabled(0) {
+        mmu.map_io(IO_IF, nullptr, [](void *context, uint8_t, uint8_t value) {
+            auto *interrupts = static_cast<Interrupts *>(context);
+            interrupts->io[IO_IF] = 0xe0 | (value & 0x1f);
+            interrupts->update();
+        }, this);
+        mmu.map_io(IO_IE, nullptr, [](void *context, uint8_t, uint8_t value) {
+            auto *interrupts = static_cast<Interrupts *>(context);
+            interrupts->enabled = value;
+            interrupts->update();
+        }, this);
+        scheduler.set_handler(Event::INTERRUPT, [](void *interrupts, uint64_t) {
+            static_cast<Interrupts *>(interrupts)->service();
+        }, this);
+        z80.interrupt_hook = [](void *interrupts) {
+            static_cast<Interrupts *>(interrupts)->update();
+        };
+        z80.interrupt_context = this;
+        mmu.write_io(IO_IF, 0);
+    }
+
+    // IF itself is saved with the I/O registers
+    struct State {
+        uint8_t enabled;
+    };
+
+    void save(State &state) const {
+        state.enabled = enabled;
+    }
+
+    void load(const State &state) {
+        enabled = state.enabled;
+    }
+
+    // Set bits in IF on behalf of a component
+    void request(uint8_t mask) {
+        mmu.write_io(IO_IF, io[IO_IF] | mask);
+    }
+};
+
+#endif //RGB_INTERRUPTS_CPP
@@ -0,0 +1,76 @@
+#ifndef RGB_JOYPAD_CPP
+#define RGB_JOYPAD_CPP
+
+#include <cstdint>
+#include "mmu.hpp"
+#include "interrupts.cpp"
+
+// Pressed buttons, one bit each. The low nibble is the direction group
+// and the high nibble the button group, in P1 bit order.
+enum Button : uint8_t {
+    BUTTON_RIGHT = 0x01,
+    BUTTON_LEFT = 0x02,
+    BUTTON_UP = 0x04,
+    BUTTON_DOWN = 0x08,
+    BUTTON_A = 0x10,
+    BUTTON_B = 0x20,
+    BUTTON_SELECT = 0x40,
+    BUTTON_START = 0x80
+};
+
+class Joypad {
+  private:
+    MMU &mmu;
+    Interrupts &interrupts;
+    uint8_t pressed;
+
+    // P1 keeps only the two group selects; the low nibble reads the
+    // selected groups, active low
+    uint8_t read_p1() const {
+        uint8_t select = mmu.io_registers()[IO_P1] & 0x30;
+        uint8_t lines = 0;
+        if (!(select & 0x10)) {
+            lines |= pressed & 0x0f;
+        }
+        if (!(select & 0x20)) {
+            lines |= pressed >> 4;
+        }
+        return 0xc0 | select | (~lines & 0x0f);
+    }
+
+  public:
+    Joypad(MMU &_mmu, Interrupts &_interrupts) : mmu(_mmu), interrupts(_interrupts), pressed(0) {
+        mmu.map_io(IO_P1, [](void *joypad, uint8_t) {
+            return static_cast<Joypad *>(joypad)->read_p1();
+        }, [](void *joypad, uint8_t, uint8_t value) {
+            static_cast<Joypad *>(joypad)->mmu.io_registers()[IO_P1] = value & 0x30;
+        }, this);
+        mmu.wb(0xff00 | IO_P1, 0x30);
+    }
+
+    struct State {
+        uint8_t pressed;
+    };
+
+    void save(State &state) const {
+        state.pressed = pressed;
+    }
+
+    void load(const State &state) {
+        pressed = state.pressed;
+    }
+
+    uint8_t buttons() const {
+        return pressed;
+    }
+
+    // A newly pressed button raises the joypad interrupt
+    void set_buttons(uint8_t buttons) {
+        if (buttons & ~pressed) {
+            interrupts.request(INT_JOYPAD);
+        }
+        pressed = buttons;
+    }
+};
+
+#endif //RGB_JOYPAD_CPP
@@ -0,0 +1,58 @@
+#ifndef RGB_LIVE_STATS_CPP
+#define RGB_LIVE_STATS_CPP
+
+#include <chrono>
+#include "machine.cpp"
+#include "util/live_stats.hpp"
+
+// Wraps a frontend for RGB::run_loop and publishes the machine's counters
+// to a LiveStats segment after every presented frame. Busy time runs from
+// one present() returning to the next being called, so it covers the
+// frame, any run-ahead and nothing spent waiting on the display or audio.
+// The clock is read through the vDSO, so this adds no syscalls.
+//
+// Frontend supplies present(frame), resample_rate(), buttons() and
+// audio_underruns().
+template <class Frontend>
+class StatsPublisher {
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    Frontend &frontend;
+    RGB &rgb;
+    LiveStats &stats;
+    Clock::time_point resumed = Clock::now();
+    Clock::duration busy{};
+
+  public:
+    StatsPublisher(Frontend &_frontend, RGB &_rgb, LiveStats &_stats)
+        : frontend(_frontend), rgb(_rgb), stats(_stats) {}
+
+    bool present(const Framebuffer &frame) {
+        Clock::time_point now = Clock::now();
+        busy += now - resumed;
+        auto ns = [](Clock::duration duration) {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+        };
+        stats.publish({ ns(now.time_since_epoch()), rgb.frames(), ns(busy), rgb.instructions(), rgb.cycles(),
+                        rgb.skipped_cycles(), frontend.audio_underruns() });
+
+        bool open = frontend.present(frame);
+        resumed = Clock::now();
+        return open;
+    }
+
+    double resample_rate() {
+        return frontend.resample_rate();
+    }
+
+    uint8_t buttons() {
+        return frontend.buttons();
+    }
+
+    uint64_t audio_underruns() const {
+        return frontend.audio_underruns();
+    }
+};
+
+#endif //RGB_LIVE_STATS_CPP
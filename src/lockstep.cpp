@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "machine.cpp"
+
+// Differential validation of fast paths. Two machines run the same ROM
+// with the same scripted input, one as configured for speed and one with
+// the fast paths off, one instruction at a time. PC and the cycle count
+// are compared after every instruction, and every register plus a hash
+// of all memory at each block boundary (a jump, call, return, RST, HALT,
+// EI or an interrupt). The first divergence stops the run and prints the
+// instructions leading up to it.
+//
+//   rgb_lockstep [rom] [--frames N] [--trace N] [--seed N]
+//
+// Today the only such fast path is HALT skipping to the next event; a new
+// one (block cache, fused ops, lazy flags) gets a setter on RGB that the
+// reference machine turns off below.
+
+namespace {
+
+struct TraceEntry {
+    uint16_t pc;
+    uint8_t bytes[3];
+    Registers before;
+    uint64_t cycles;
+};
+
+void configure_reference(RGB &rgb)
+{
+    rgb.set_idle_skip(false);
+}
+
+// Buttons for a frame: a new random combination every eight frames, with
+// the d-pad never holding opposite directions
+uint8_t scripted_buttons(uint64_t frame, uint32_t seed)
+{
+    uint64_t x = hash_mix((frame / 8) ^ ((uint64_t) seed << 32));
+    auto buttons = static_cast<uint8_t>(x);
+    if ((buttons & (BUTTON_LEFT | BUTTON_RIGHT)) == (BUTTON_LEFT | BUTTON_RIGHT)) {
+        buttons &= ~BUTTON_LEFT;
+    }
+    if ((buttons & (BUTTON_UP | BUTTON_DOWN)) == (BUTTON_UP | BUTTON_DOWN)) {
+        buttons &= ~BUTTON_UP;
+    }
+    return buttons;
+}
+
+void print_registers(std::ostream &out, const Registers &reg)
+{
+    char text[96];
+    std::snprintf(text, sizeof(text),
+                  "AF=%02x%02x BC=%02x%02x DE=%02x%02x HL=%02x%02x SP=%04x PC=%04x IME=%d",
+                  reg.a, static_cast<uint8_t>(reg.f), reg.b, reg.c, reg.d, reg.e, reg.h, reg.l,
+                  reg.sp, reg.pc, reg.ime);
+    out << text;
+}
+
+bool same_registers(const Registers &a, const Registers &b)
+{
+    return a.a == b.a && a.f == b.f && a.b == b.b && a.c == b.c && a.d == b.d && a.e == b.e
+        && a.h == b.h && a.l == b.l && a.sp == b.sp && a.pc == b.pc && a.ime == b.ime;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    std::string rom_path = RGB::DEFAULT_ROM;
+    uint64_t frames = 600;
+    size_t trace_length = 32;
+    uint32_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_length = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (argv[i][0] != '-') {
+            rom_path = argv[i];
+        } else {
+            std::cerr << "usage: rgb_lockstep [rom] [--frames N] [--trace N] [--seed N]\n";
+            return 2;
+        }
+    }
+
+    std::unique_ptr<RGB> fast, reference;
+    try {
+        std::vector<uint8_t> rom = MMU::read_rom(rom_path);
+        fast.reset(new RGB(rom));
+        reference.reset(new RGB(rom));
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    configure_reference(*reference);
+
+    // Ring of the reference machine's latest instructions
+    std::vector<TraceEntry> trace(trace_length);
+    uint64_t traced = 0;
+    uint64_t boundaries = 0;
+    uint64_t fast_frames = 0, reference_frames = 0;
+
+    std::string divergence;
+    bool stopped = false;
+    while (reference->frames() < frames && divergence.empty()) {
+        const Registers &reg = reference->registers();
+        TraceEntry &entry = trace[traced++ % trace_length];
+        entry.pc = reg.pc;
+        entry.before = reg;
+        entry.cycles = reference->cycles();
+        for (int i = 0; i < 3; i++) {
+            entry.bytes[i] = reference->peek(static_cast<uint16_t>(reg.pc + i));
+        }
+
+        bool fast_running = fast->step_instruction();
+        bool reference_running = reference->step_instruction();
+        if (fast_running != reference_running) {
+            divergence = "only one machine stopped";
+            break;
+        }
+        if (!reference_running) {
+            stopped = true;
+            break;
+        }
+
+        // Both apply the same input when their frame counts move on
+        if (fast->frames() != fast_frames) {
+            fast_frames = fast->frames();
+            fast->set_buttons(scripted_buttons(fast_frames, seed));
+        }
+        if (reference->frames() != reference_frames) {
+            reference_frames = reference->frames();
+            reference->set_buttons(scripted_buttons(reference_frames, seed));
+        }
+
+        const Registers &a = fast->registers(), &b = reference->registers();
+        if (a.pc != b.pc) {
+            divergence = "PC differs";
+        } else if (fast->cycles() != reference->cycles()) {
+            divergence = "cycle count differs";
+        } else if (fast_frames != reference_frames) {
+            divergence = "frame count differs";
+        } else {
+            uint8_t length = entry.bytes[0] == 0xcb ? 2 : OPCODES[entry.bytes[0]].length;
+            bool jumped = b.pc != static_cast<uint16_t>(entry.pc + length);
+            if (ends_block(entry.bytes[0]) || jumped) {
+                boundaries++;
+                if (!same_registers(a, b)) {
+                    divergence = "registers differ";
+                } else if (fast->ram_hash() != reference->ram_hash()) {
+                    divergence = "memory differs";
+                }
+            }
+        }
+    }
+
+    if (divergence.empty()) {
+        std::cout << "no divergence in " << reference->frames() << " frames, "
+                  << reference->instructions() << " instructions, " << boundaries
+                  << " block boundaries checked" << (stopped ? " before the CPU stopped" : "") << "\n";
+        return 0;
+    }
+
+    std::cout << "divergence after instruction " << reference->instructions() << " ("
+              << reference->frames() << " frames): " << divergence << "\n\nlast instructions:\n";
+    uint64_t first = traced > trace_length ? traced - trace_length : 0;
+    for (uint64_t i = first; i < traced; i++) {
+        const TraceEntry &entry = trace[i % trace_length];
+        char prefix[32];
+        std::snprintf(prefix, sizeof(prefix), "%10llu  %04x  ", (unsigned long long) entry.cycles, entry.pc);
+        std::string text = disassemble(entry.bytes, entry.pc);
+        text.resize(std::max<size_t>(text.size(), 16), ' ');
+        std::cout << prefix << text << "  ";
+        print_registers(std::cout, entry.before);
+        std::cout << "\n";
+    }
+    std::cout << "\nfast:      cycle " << fast->cycles() << "  ";
+    print_registers(std::cout, fast->registers());
+    std::cout << "  memory " << std::hex << fast->ram_hash() << std::dec;
+    std::cout << "\nreference: cycle " << reference->cycles() << "  ";
+    print_registers(std::cout, reference->registers());
+    std::cout << "  memory " << std::hex << reference->ram_hash() << std::dec << "\n";
+    return 1;
+}
@@ -0,0 +1,356 @@
+#ifndef RGB_MACHINE_CPP
+#define RGB_MACHINE_CPP
+
+#include <algorithm>
+#include <chrono>
+#include <ostream>
+#include <utility>
+#include <vector>
+#include "z80.cpp"
+#include "gpu.cpp"
+#include "apu.cpp"
+#include "dma.cpp"
+#include "interrupts.cpp"
+#include "joypad.cpp"
+#include "scheduler.cpp"
+#include "timer.cpp"
+#include "util/perf_counters.hpp"
+#include "util/trace.hpp"
+
+// The whole console without any I/O to the host: frames, sound and input
+// go through a frontend, or nowhere when benchmarking
+class RGB {
+  public:
+    // Everything that changes while running, for save states
+    struct Snapshot {
+        MMU::State mmu;
+        Scheduler::State scheduler;
+        Registers reg;
+        Clock clock;
+        bool halt, stop;
+        Interrupts::State interrupts;
+        Hdma::State hdma;
+        GPU::State gpu;
+        Joypad::State joypad;
+        Timer::State timer;
+        Apu::State apu;
+        uint64_t gpu_clock, idle_cycles, retired, frames_done;
+    };
+
+  private:
+    MMU mmu;
+    Scheduler scheduler;
+    Z80 z80 = Z80(mmu);
+    Interrupts interrupts = Interrupts(mmu, scheduler, z80);
+    OamDma dma = OamDma(mmu, scheduler);
+    Hdma hdma = Hdma(mmu, scheduler);
+    GPU gpu = GPU(mmu, interrupts, hdma);
+    Joypad joypad = Joypad(mmu, interrupts);
+    Timer timer = Timer(mmu, scheduler, interrupts);
+    Apu apu{mmu, scheduler};
+
+    // Cycle the GPU has been stepped up to. It trails the scheduler by any
+    // interrupt dispatch or DMA time, which it picks up on the next step.
+    uint64_t gpu_clock = 0;
+
+    // T-cycles skipped while halted instead of stepping NOPs
+    uint64_t idle_cycles = 0;
+    // Instructions executed and frames completed
+    uint64_t retired = 0;
+    uint64_t frames_done = 0;
+    // Jump over HALT to the next event; off, HALT is stepped an M-cycle at
+    // a time as a reference for validating the skip
+    bool idle_skip = true;
+    PerfProfiler *profiler = nullptr;
+
+    // Frames to run ahead of the one presented, and what it cost
+    int run_ahead = 0;
+    Snapshot run_ahead_state;
+    uint64_t run_ahead_frames = 0;
+    std::chrono::steady_clock::duration save_time{}, ahead_time{}, load_time{};
+
+    // While halted nothing changes until the next scheduled event or GPU
+    // mode change, so jump straight there, in whole M-cycles
+    uint32_t halted_cycles() {
+        uint64_t gpu_until = (uint64_t) gpu.cycles_to_next_mode() << mmu.double_speed;
+        uint64_t until = std::min<uint64_t>({ scheduler.until_next(), gpu_until, 0x4000 });
+        uint32_t cycles = static_cast<uint32_t>(std::max<uint64_t>(4, (until + 3) & ~3ull));
+        idle_cycles += cycles;
+        return cycles;
+    }
+
+    void step() {
+        uint32_t cycles;
+        if (z80.halt) {
+            cycles = idle_skip ? halted_cycles() : 4;
+        } else {
+            z80.exec();
+            cycles = z80.reg.t;
+            retired++;
+        }
+        // Step the GPU first so an interrupt it raises is taken by
+        // this advance, before the next instruction. The scheduler
+        // counts CPU cycles; in double speed the GPU gets half as many.
+        uint64_t target = scheduler.cycles() + cycles;
+        auto dots = static_cast<uint16_t>((target - gpu_clock) >> mmu.double_speed);
+        gpu.step(dots);
+        gpu_clock += (uint64_t) dots << mmu.double_speed;
+        scheduler.advance(cycles);
+    }
+
+    void finish_frame() {
+        gpu.frame_ready = false;
+        apu.end_frame();
+        frames_done++;
+    }
+
+    // Save, run the next frames with the current input so the framebuffer
+    // shows where they lead, then go back. Sound is muted while ahead, and
+    // the profiler detached: those frames would repeat frame numbers and
+    // skew its per-frame means, and report_run_ahead() covers their cost.
+    void run_ahead_of_frame() {
+        RGB_TRACE_SCOPE("run ahead");
+        using Clock = std::chrono::steady_clock;
+        Clock::time_point start = Clock::now();
+        save_state(run_ahead_state);
+        Clock::time_point saved = Clock::now();
+
+        PerfProfiler *attached = profiler;
+        set_profiler(nullptr);
+        apu.set_muted(true);
+        for (int i = 0; i < run_ahead; i++) {
+            if (!run_frame()) {
+                break;
+            }
+        }
+        apu.set_muted(false);
+        set_profiler(attached);
+        Clock::time_point ran = Clock::now();
+
+        load_state(run_ahead_state);
+        Clock::time_point loaded = Clock::now();
+
+        save_time += saved - start;
+        ahead_time += ran - saved;
+        load_time += loaded - ran;
+        run_ahead_frames++;
+    }
+
+  public:
+    static constexpr const char *DEFAULT_ROM = "../rom/opus5.gb";
+
+    // Starts at the cartridge entry point with the registers the boot ROM
+    // would have left
+    explicit RGB(std::vector<uint8_t> rom) : mmu(std::move(rom)) {
+        z80.post_boot(mmu.cgb);
+        mmu.inbios = false;
+    }
+
+    RGB(const RGB &) = delete;
+    RGB &operator=(const RGB &) = delete;
+
+    // Run until the GPU completes a frame and queue its sound; false if
+    // the CPU stopped first
+    bool run_frame() {
+        // Traced as CPU time; the GPU and APU work in it has nested scopes
+        RGB_TRACE_SCOPE("cpu");
+        if (profiler) {
+            profiler->begin_frame();
+        }
+        while (!z80.stop) {
+            step();
+            if (gpu.frame_ready) {
+                finish_frame();
+                if (profiler) {
+                    profiler->end_frame(frames_done);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Run until the next instruction has executed, finishing any frame
+    // completed on the way as run_frame() does; false once the CPU stopped
+    bool step_instruction() {
+        uint64_t start = retired;
+        while (!z80.stop) {
+            step();
+            if (gpu.frame_ready) {
+                finish_frame();
+            }
+            if (retired != start) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const Framebuffer &frame() {
+        return gpu.frame();
+    }
+
+    // T-cycles since power on
+    uint64_t cycles() const {
+        return scheduler.cycles();
+    }
+
+    uint64_t instructions() const {
+        return retired;
+    }
+
+    // T-cycles jumped over while halted rather than stepped
+    uint64_t skipped_cycles() const {
+        return idle_cycles;
+    }
+
+    uint64_t frames() const {
+        return frames_done;
+    }
+
+    bool cgb() const {
+        return mmu.cgb;
+    }
+
+    const Registers &registers() const {
+        return z80.reg;
+    }
+
+    // Read memory as the CPU would, for inspection
+    uint8_t peek(uint16_t addr) {
+        return mmu.rb(addr);
+    }
+
+    uint64_t ram_hash() {
+        return mmu.ram_hash();
+    }
+
+    uint8_t buttons() const {
+        return joypad.buttons();
+    }
+
+    void set_buttons(uint8_t buttons) {
+        joypad.set_buttons(buttons);
+    }
+
+    void set_idle_skip(bool enabled) {
+        idle_skip = enabled;
+    }
+
+    void save_state(Snapshot &state) const {
+        RGB_TRACE_SCOPE("save state");
+        mmu.save(state.mmu);
+        scheduler.save(state.scheduler);
+        state.reg = z80.reg;
+        state.clock = z80.clock;
+        state.halt = z80.halt;
+        state.stop = z80.stop;
+        interrupts.save(state.interrupts);
+        hdma.save(state.hdma);
+        gpu.save(state.gpu);
+        joypad.save(state.joypad);
+        timer.save(state.timer);
+        apu.save(state.apu);
+        state.gpu_clock = gpu_clock;
+        state.idle_cycles = idle_cycles;
+        state.retired = retired;
+        state.frames_done = frames_done;
+    }
+
+    void load_state(const Snapshot &state) {
+        RGB_TRACE_SCOPE("load state");
+        mmu.load(state.mmu);
+        scheduler.load(state.scheduler);
+        z80.reg = state.reg;
+        z80.clock = state.clock;
+        z80.halt = state.halt;
+        z80.stop = state.stop;
+        interrupts.load(state.interrupts);
+        hdma.load(state.hdma);
+        gpu.load(state.gpu);
+        joypad.load(state.joypad);
+        timer.load(state.timer);
+        apu.load(state.apu);
+        gpu_clock = state.gpu_clock;
+        idle_cycles = state.idle_cycles;
+        retired = state.retired;
+        frames_done = state.frames_done;
+    }
+
+    // Present each frame as it will look frames ahead. Needs the
+    // synchronous renderer, as the pipeline can't be rewound.
+    void set_run_ahead(int frames) {
+        run_ahead = frames;
+    }
+
+    void set_pipelined(bool enabled) {
+        gpu.set_pipelined(enabled);
+    }
+
+    void set_rendering(bool enabled) {
+        gpu.set_rendering(enabled);
+    }
+
+    void set_frame_hashing(bool enabled) {
+        gpu.set_frame_hashing(enabled);
+    }
+
+    // Report hardware counters for every frame run_frame() completes, not
+    // counting frames run ahead, or stop with nullptr. The profiler must be
+    // used on this thread only.
+    void set_profiler(PerfProfiler *value) {
+        profiler = value;
+        gpu.set_profiler(value);
+        apu.set_profiler(value);
+    }
+
+    AudioRing &audio_output() {
+        return apu.output();
+    }
+
+    void set_sample_rate(double rate) {
+        apu.set_sample_rate(rate);
+    }
+
+    // Frontend supplies present(frame), resample_rate() and buttons()
+    template <class Frontend>
+    void run_loop(Frontend &presenter) {
+        while (run_frame()) {
+            if (run_ahead > 0) {
+                run_ahead_of_frame();
+            }
+            bool open;
+            {
+                RGB_TRACE_SCOPE("present");
+                open = presenter.present(gpu.frame());
+            }
+            if (!open) {
+                break;
+            }
+            apu.set_sample_rate(presenter.resample_rate());
+            joypad.set_buttons(presenter.buttons());
+        }
+    }
+
+    // Average cost of run-ahead per presented frame
+    void report_run_ahead(std::ostream &out) const {
+        if (run_ahead_frames == 0) {
+            return;
+        }
+        auto average_us = [&](std::chrono::steady_clock::duration total) {
+            return std::chrono::duration<double, std::micro>(total).count() / run_ahead_frames;
+        };
+        out << "run-ahead " << run_ahead << ": " << run_ahead_frames << " frames, per frame "
+            << average_us(save_time) << " us save, " << average_us(ahead_time) << " us ahead, "
+            << average_us(load_time) << " us restore\n";
+    }
+
+    // Digest of the whole machine state, for deduplicating explored states.
+    // Only memory pages written since the previous call are rehashed.
+    uint64_t state_hash() {
+        return hash_mix(mmu.ram_hash() ^ hash_rotl(z80.reg.hash(), 17) ^ hash_rotl(gpu.hash(), 41)
+                        ^ hash_rotl(timer.hash(), 7));
+    }
+};
+
+#endif //RGB_MACHINE_CPP
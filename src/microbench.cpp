@@ -0,0 +1,360 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "assembler.cpp"
+#include "machine.cpp"
+#include "util/bench_stats.hpp"
+#include "util/perf_counters.hpp"
+
+// Micro-benchmarks of single hot paths: MMU accesses per region, one
+// scanline of rendering, and one instruction per opcode class. Each case
+// is calibrated to run for --batch-ms per batch, warmed up with one batch,
+// then timed over --batches batches on a pinned CPU. Compare the median
+// ns per operation between commits: unlike the mean it ignores the odd
+// batch that was preempted, and is steady enough to show a 5% change.
+//
+//   rgb_microbench --filter mmu.rb --batches 30 > micro.json
+//
+// --counters runs one more batch under the hardware counters and reports
+// them per operation, so e.g. the branch misses of MMU::rb and of opcode
+// dispatch can be told apart.
+
+namespace {
+
+using BenchClock = std::chrono::steady_clock;
+
+struct MicroCase {
+    std::string name;
+    // Perform the operation iterations times
+    std::function<void(uint64_t iterations)> run;
+};
+
+// The components a running machine has, without the CPU loop, so that
+// I/O registers are served by their real handlers
+struct Bench {
+    MMU mmu;
+    Scheduler scheduler;
+    Z80 z80{mmu};
+    Interrupts interrupts{mmu, scheduler, z80};
+    Hdma hdma{mmu, scheduler};
+    GPU gpu{mmu, interrupts, hdma};
+    Timer timer{mmu, scheduler, interrupts};
+
+    explicit Bench(std::vector<uint8_t> rom) : mmu(std::move(rom)) {
+        mmu.inbios = false;
+    }
+};
+
+double time_batch(const MicroCase &c, uint64_t iterations)
+{
+    BenchClock::time_point start = BenchClock::now();
+    c.run(iterations);
+    std::chrono::duration<double> elapsed = BenchClock::now() - start;
+    return elapsed.count();
+}
+
+// Region name and base address; accesses walk 64 bytes from base
+struct Region {
+    const char *name;
+    uint16_t base;
+    uint16_t mask;
+};
+
+const Region READ_REGIONS[] = {
+    { "rom", 0x0150, 0x3f },
+    { "vram", 0x8000, 0x3f },
+    { "wram", 0xc000, 0x3f },
+    { "echo", 0xe000, 0x3f },
+    { "oam", 0xfe00, 0x3f },
+    { "io_plain", 0xff47, 0 },   // BGP, storage only
+    { "io_handler", 0xff41, 0 }, // STAT, computed by the GPU
+    { "hram", 0xff80, 0x3f },
+};
+
+const Region WRITE_REGIONS[] = {
+    { "vram", 0x8000, 0x3f },
+    { "wram", 0xc000, 0x3f },
+    { "echo", 0xe000, 0x3f },
+    { "oam", 0xfe00, 0x3f },
+    { "io_plain", 0xff47, 0 },   // BGP
+    { "io_handler", 0xff05, 0 }, // TIMA, reschedules the overflow
+    { "hram", 0xff80, 0x3f },
+};
+
+void add_mmu_cases(std::vector<MicroCase> &cases, Bench &bench)
+{
+    MMU &mmu = bench.mmu;
+    for (const Region &region : READ_REGIONS) {
+        uint16_t base = region.base, mask = region.mask;
+        cases.push_back({ std::string("mmu.rb.") + region.name, [&mmu, base, mask](uint64_t n) {
+            uint32_t sum = 0;
+            for (uint64_t i = 0; i < n; i++) {
+                sum += mmu.rb(static_cast<uint16_t>(base + (i & mask)));
+            }
+            bench_keep(sum);
+        } });
+        cases.push_back({ std::string("mmu.rw.") + region.name, [&mmu, base, mask](uint64_t n) {
+            uint32_t sum = 0;
+            for (uint64_t i = 0; i < n; i++) {
+                sum += mmu.rw(static_cast<uint16_t>(base + (i & mask & ~1u)));
+            }
+            bench_keep(sum);
+        } });
+    }
+    for (const Region &region : WRITE_REGIONS) {
+        uint16_t base = region.base, mask = region.mask;
+        cases.push_back({ std::string("mmu.wb.") + region.name, [&mmu, base, mask](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                mmu.wb(static_cast<uint16_t>(base + (i & mask)), static_cast<uint8_t>(i));
+            }
+        } });
+        if (mask) {
+            cases.push_back({ std::string("mmu.ww.") + region.name, [&mmu, base, mask](uint64_t n) {
+                for (uint64_t i = 0; i < n; i++) {
+                    mmu.ww(static_cast<uint16_t>(base + (i & mask & ~1u)), static_cast<uint16_t>(i));
+                }
+            } });
+        }
+    }
+}
+
+// Scroll settings for the scanline cases; window and sprites on where
+// noted
+struct ScanSetup {
+    const char *name;
+    uint8_t scx, scy, lcdc, wx, wy;
+    bool sprites;
+};
+
+const ScanSetup SCAN_SETUPS[] = {
+    { "aligned", 0, 0, 0x91, 0, 0, false },
+    { "scx3", 3, 0, 0x91, 0, 0, false },
+    { "scx255_scy143", 255, 143, 0x91, 0, 0, false },
+    { "signed_tiles", 5, 17, 0x81, 0, 0, false },
+    { "window", 3, 0, 0xb1, 87, 0, false },
+    { "sprites", 3, 0, 0x93, 0, 0, true },
+    { "window_sprites", 3, 0, 0xf3, 87, 0, true },
+};
+
+void add_scanline_cases(std::vector<MicroCase> &cases, Bench &bench)
+{
+    std::mt19937 random(42);
+    for (uint32_t addr = 0x8000; addr < 0xa000; addr++) {
+        bench.mmu.wb(static_cast<uint16_t>(addr), static_cast<uint8_t>(random()));
+    }
+
+    for (const ScanSetup &setup : SCAN_SETUPS) {
+        cases.push_back({ std::string("gpu.render_scan.") + setup.name, [&bench, setup](uint64_t n) {
+            MMU &mmu = bench.mmu;
+            GPU &gpu = bench.gpu;
+            // Ten sprites on line 0, or none
+            for (int i = 0; i < 40; i++) {
+                uint8_t y = setup.sprites && i < 10 ? 16 : 0;
+                mmu.wb(static_cast<uint16_t>(0xfe00 + i * 4), y);
+                mmu.wb(static_cast<uint16_t>(0xfe01 + i * 4), static_cast<uint8_t>(8 + i * 15));
+                mmu.wb(static_cast<uint16_t>(0xfe02 + i * 4), static_cast<uint8_t>(i));
+                mmu.wb(static_cast<uint16_t>(0xfe03 + i * 4), static_cast<uint8_t>(i << 4));
+            }
+            mmu.wb(0xff00 | IO_SCX, setup.scx);
+            mmu.wb(0xff00 | IO_SCY, setup.scy);
+            mmu.wb(0xff00 | IO_WX, setup.wx);
+            mmu.wb(0xff00 | IO_WY, setup.wy);
+            mmu.wb(0xff00 | IO_LCDC, setup.lcdc);
+            gpu.scan_oam();
+            // render_scan() moves the window down a row each time, so put
+            // it back to time the same line throughout. Done in every case
+            // to keep them comparable.
+            GPU::State start;
+            gpu.save(start);
+            for (uint64_t i = 0; i < n; i++) {
+                gpu.load(start);
+                gpu.render_scan();
+            }
+        } });
+    }
+}
+
+// One representative instruction per class
+struct OpCase {
+    const char *name;
+    const char *source;
+};
+
+const OpCase OP_CASES[] = {
+    { "nop", "nop" },
+    { "ld_r_r", "ld a, b" },
+    { "ld_r_n", "ld a, $12" },
+    { "ld_r_hl", "ld a, (hl)" },
+    { "ld_hl_r", "ld (hl), a" },
+    { "ld_rr_nn", "ld hl, $c100" },
+    { "ldh_a_n", "ldh a, ($80)" },
+    { "alu_r", "add a, b" },
+    { "alu_n", "and $5a" },
+    { "alu_hl", "xor (hl)" },
+    { "inc_r", "inc b" },
+    { "inc_rr", "inc bc" },
+    { "add_hl_rr", "add hl, bc" },
+    { "rotate_a", "rlca" },
+    { "cb_bit", "bit 0, a" },
+    { "cb_shift", "sla b" },
+    { "cb_hl", "rlc (hl)" },
+    { "jr", "jr @next" },
+    { "jr_cc", "jr nz, @next" },
+    { "jp", "jp $0200" },
+    { "call", "call $0200" },
+    { "ret", "ret" },
+    { "push", "push bc" },
+    { "pop", "pop bc" },
+};
+
+// Each op is assembled at its own address, 4 bytes apart; the loop
+// restores PC, SP and HL before every dispatch so jumps and stack ops
+// stay in place
+void add_dispatch_cases(std::vector<MicroCase> &cases, Bench &bench, uint16_t code_base)
+{
+    int index = 0;
+    for (const OpCase &op : OP_CASES) {
+        uint16_t pc = static_cast<uint16_t>(code_base + index * 4);
+        uint8_t opcode = bench.mmu.rb(pc);
+        index++;
+        cases.push_back({ std::string("z80.dispatch_op.") + op.name, [&bench, opcode, pc](uint64_t n) {
+            Z80 &z80 = bench.z80;
+            z80.reg.f = Flags::None;
+            for (uint64_t i = 0; i < n; i++) {
+                z80.reg.pc = static_cast<uint16_t>(pc + 1);
+                z80.reg.sp = 0xdffe;
+                z80.reg.h = 0xc1;
+                z80.dispatch_op(opcode);
+            }
+            bench_keep(z80.reg);
+        } });
+    }
+}
+
+std::vector<uint8_t> dispatch_rom(uint16_t code_base)
+{
+    Assembler as;
+    int index = 0;
+    for (const OpCase &op : OP_CASES) {
+        uint16_t pc = static_cast<uint16_t>(code_base + index * 4);
+        as.org(pc);
+        // JR cases jump to the following slot
+        std::string source = op.source;
+        size_t next = source.find("@next");
+        if (next != std::string::npos) {
+            source.replace(next, 5, std::to_string(pc + 4));
+        }
+        as(source);
+        index++;
+    }
+    return as.rom();
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    int batches = 20;
+    double batch_ms = 10;
+    int cpu = 0;
+    bool pin = true;
+    std::string filter;
+    bool count = false;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--batches") == 0 && i + 1 < argc) {
+            batches = std::max(2, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--batch-ms") == 0 && i + 1 < argc) {
+            batch_ms = std::max(1.0, std::atof(argv[++i]));
+        } else if (std::strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+            cpu = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--no-pin") == 0) {
+            pin = false;
+        } else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (std::strcmp(argv[i], "--counters") == 0) {
+            count = true;
+        } else {
+            std::cerr << "usage: rgb_microbench [--batches N] [--batch-ms MS] [--cpu N] [--no-pin]"
+                         " [--filter NAME] [--counters]\n";
+            return 2;
+        }
+    }
+    bool pinned = pin && bench_pin_cpu(cpu);
+    if (pin && !pinned) {
+        std::cerr << "Couldn't pin to CPU " << cpu << "; timings may be noisier\n";
+    }
+
+    constexpr uint16_t CODE_BASE = 0x0200;
+    Bench bench(dispatch_rom(CODE_BASE));
+    std::vector<MicroCase> cases;
+    add_mmu_cases(cases, bench);
+    add_scanline_cases(cases, bench);
+    add_dispatch_cases(cases, bench, CODE_BASE);
+
+    std::unique_ptr<PerfCounters> counters;
+    if (count) {
+        counters.reset(new PerfCounters());
+        if (!counters->any()) {
+            std::cerr << "No performance counters available\n";
+            return 1;
+        }
+        if (!counters->missing().empty()) {
+            std::cerr << "Not counted here: " << counters->missing() << "\n";
+        }
+    }
+
+    std::ostream &out = std::cout;
+    out << "{\n  \"batches\": " << batches << ",\n  \"batch_ms\": " << batch_ms
+        << ",\n  \"pinned\": " << (pinned ? "true" : "false") << ",\n  \"cases\": [";
+    bool first = true;
+    for (const MicroCase &c : cases) {
+        if (!filter.empty() && c.name.find(filter) == std::string::npos) {
+            continue;
+        }
+
+        // Grow the batch until it fills batch_ms; this doubles as warm-up
+        uint64_t iterations = 1024;
+        double seconds;
+        while ((seconds = time_batch(c, iterations)) < batch_ms / 1000 / 2) {
+            iterations *= 2;
+        }
+        iterations = std::max<uint64_t>(1, static_cast<uint64_t>(iterations * (batch_ms / 1000) / seconds));
+        time_batch(c, iterations);
+
+        std::vector<double> ns;
+        for (int batch = 0; batch < batches; batch++) {
+            ns.push_back(time_batch(c, iterations) * 1e9 / iterations);
+        }
+
+        out << (first ? "\n" : ",\n") << "    {\n"
+            << "      \"name\": \"" << c.name << "\",\n"
+            << "      \"iterations\": " << iterations << ",\n";
+        bench_print_stats(out, "      ", "ns_per_op", ns);
+        if (counters) {
+            PerfCounters::Sample start = counters->read();
+            c.run(iterations);
+            PerfCounters::Sample counted = counters->read() - start;
+            out << ",\n      \"counters_per_op\": {";
+            const char *separator = " ";
+            for (int event = 0; event < PerfCounters::EVENTS; event++) {
+                if (counters->available(event)) {
+                    out << separator << "\"" << PerfCounters::name(event) << "\": "
+                        << static_cast<double>(counted.values[event]) / iterations;
+                    separator = ", ";
+                }
+            }
+            out << " }";
+        }
+        out << "\n    }";
+        first = false;
+    }
+    out << "\n  ]\n}\n";
+    return 0;
+}
@@ -1,31 +1,347 @@
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 #include "mmu.hpp"
 #include "util/util.cpp"
+#include "util/hash.hpp"
 
-MMU::MMU() {
-    load_rom();
+MMU::MMU(std::vector<uint8_t> _rom) : rom(std::move(_rom)), vram_bank(0), wram_bank(0x1000),
+             io_handlers(), ie_handler(), dma_reader(nullptr), dma_context(nullptr), inbios(true),
+             double_speed(false), vram_version(0), palette_version(0), dma_lockout(false) {
+    std::fill(std::begin(dirty_tiles), std::end(dirty_tiles), ~0ull);
+    if (rom.size() < 0x8000) {
+        rom.resize(0x8000, 0xff);
+    }
+    std::fill(std::begin(rom_written), std::end(rom_written), 0);
+    rom_original.assign(rom.begin(), rom.begin() + 0x8000);
+    cgb = rom.size() > 0x143 && (rom[0x143] & 0x80);
+    map_pages();
+    init_pages();
+    if (cgb) {
+        map_cgb_registers();
+    }
+}
+
+void MMU::map_cgb_registers()
+{
+    // The registers read back from io, so they are part of the state hash
+    map_io(IO_KEY1, nullptr, [](void *context, uint8_t, uint8_t value) {
+        auto *mmu = static_cast<MMU *>(context);
+        mmu->io[IO_KEY1] = static_cast<uint8_t>(0x7e | mmu->double_speed << 7 | (value & 1));
+    }, this);
+    map_io(IO_VBK, nullptr, [](void *context, uint8_t, uint8_t value) {
+        auto *mmu = static_cast<MMU *>(context);
+        mmu->io[IO_VBK] = static_cast<uint8_t>(0xfe | (value & 1));
+        mmu->vram_bank = (value & 1u) << 13;
+        mmu->map_pages();
+    }, this);
+    map_io(IO_SVBK, nullptr, [](void *context, uint8_t, uint8_t value) {
+        auto *mmu = static_cast<MMU *>(context);
+        mmu->io[IO_SVBK] = static_cast<uint8_t>(0xf8 | (value & 7));
+        // Bank 0 is always at 0xc000; selecting it maps bank 1
+        mmu->wram_bank = std::max(1u, value & 7u) << 12;
+        mmu->map_pages();
+    }, this);
+    write_io(IO_KEY1, 0);
+    write_io(IO_VBK, 0);
+    write_io(IO_SVBK, 1);
+
+    // Palette data is reached through an index register that can
+    // auto-increment after each data write
+    auto read_palette = [](void *context, uint8_t reg) {
+        auto *mmu = static_cast<MMU *>(context);
+        size_t base = reg == IO_BCPD ? 0 : 0x40;
+        return mmu->cram[base + (mmu->io[reg - 1] & 0x3f)];
+    };
+    auto write_palette = [](void *context, uint8_t reg, uint8_t value) {
+        static_cast<MMU *>(context)->write_palette(reg - 1, reg == IO_BCPD ? 0 : 0x40, value);
+    };
+    map_io(IO_BCPD, read_palette, write_palette, this);
+    map_io(IO_OCPD, read_palette, write_palette, this);
+}
+
+void MMU::write_palette(uint8_t spec_reg, size_t base, uint8_t value)
+{
+    uint8_t spec = io[spec_reg];
+    cram[base + (spec & 0x3f)] = value;
+    if (spec & 0x80) {
+        io[spec_reg] = (spec & 0x80) | ((spec + 1) & 0x3f);
+    }
+    palette_version++;
+    mark_dirty(PALETTE_PAGES);
+}
+
+bool MMU::switch_speed()
+{
+    if (!cgb || !(io[IO_KEY1] & 1)) {
+        return false;
+    }
+    double_speed = !double_speed;
+    write_io(IO_KEY1, 0);
+    return true;
+}
+
+void MMU::map_pages()
+{
+    for (size_t page = 0; page < 0x100; page++) {
+        size_t addr = page << 8;
+        if (addr < 0x8000) {
+            read_pages[page] = addr + 0x100 <= rom.size() ? rom.data() + addr : nullptr;
+        } else if (addr < 0xa000) {
+            read_pages[page] = gram.data() + vram_bank + (addr & 0x1fff);
+        } else if (addr < 0xc000) {
+            read_pages[page] = eram.data() + (addr & 0x1fff);
+        } else if (addr < 0xfe00) {
+            // 0xe000 and up echoes 0xc000
+            read_pages[page] = wram.data() + ((addr & 0x1000) ? wram_bank : 0) + (addr & 0x0fff);
+        } else {
+            read_pages[page] = nullptr;
+        }
+    }
 }
 
-void MMU::load_rom()
+void MMU::oam_dma(uint8_t page)
 {
-    std::ifstream file("../rom/opus5.gb", std::ios::in | std::ios::binary);
+    // The boot ROM overlay still needs the full decode
+    const uint8_t *source = page == 0 && inbios ? nullptr : read_pages[page];
+    if (source) {
+        std::memcpy(oam.data(), source, oam.size());
+    } else {
+        for (size_t i = 0; i < oam.size(); i++) {
+            oam[i] = rb(static_cast<uint16_t>(page << 8 | i));
+        }
+    }
+    mark_dirty(OAM_PAGES);
+}
+
+void MMU::mark_vram(size_t offset)
+{
+    mark_dirty(VRAM_PAGES + (offset >> PAGE_SHIFT));
+    if ((offset & 0x1fff) < 0x1800) {
+        size_t tile = (offset >> 13) * (TILE_COUNT / 2) + ((offset & 0x1fff) >> 4);
+        dirty_tiles[tile >> 6] |= 1ull << (tile & 63);
+    }
+}
+
+void MMU::vram_dma(uint16_t offset, uint16_t addr, size_t len)
+{
+    while (len > 0) {
+        // Stay within one source page and don't wrap the destination
+        size_t chunk = std::min({ len, size_t(0x100 - (addr & 0xff)), size_t(0x2000 - (offset & 0x1fff)) });
+        uint8_t *dest = gram.data() + vram_bank + (offset & 0x1fff);
+        const uint8_t *source = addr < 0x100 && inbios ? nullptr : read_pages[addr >> 8];
+        if (source) {
+            std::memcpy(dest, source + (addr & 0xff), chunk);
+        } else {
+            for (size_t i = 0; i < chunk; i++) {
+                dest[i] = rb(static_cast<uint16_t>(addr + i));
+            }
+        }
+        for (size_t i = 0; i < chunk; i += 0x10) {
+            mark_vram(vram_bank + (offset & 0x1fff) + i);
+        }
+        offset = static_cast<uint16_t>(offset + chunk);
+        addr = static_cast<uint16_t>(addr + chunk);
+        len -= chunk;
+    }
+    vram_version++;
+}
+
+std::vector<uint8_t> MMU::read_rom(const std::string &path)
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary);
     if (!file.good()) {
-        throw std::exception();
+        throw std::runtime_error("Can't read ROM " + path);
     }
 
-    rom.reserve(0x8000);
-    rom.insert(
-        rom.begin(),
-        std::istream_iterator<uint8_t>(file),
-        std::istream_iterator<uint8_t>());
-    file.close();
+    // istreambuf_iterator, unlike istream_iterator, keeps whitespace bytes
+    return std::vector<uint8_t>(
+        std::istreambuf_iterator<char>(file),
+        std::istreambuf_iterator<char>());
+}
+
+void MMU::init_pages()
+{
+    page_count = ROM_PAGES + ((rom.size() + 0xff) >> PAGE_SHIFT);
+    dirty_pages.assign((page_count + 63) / 64, 0);
+    page_hash.assign(page_count, 0);
+    combined_hash = 0;
+    for (size_t page = 0; page < page_count; page++) {
+        rehash_page(page);
+    }
+}
+
+void MMU::rehash_page(size_t page)
+{
+    const uint8_t *data;
+    size_t len = 0x100;
+    if (page >= ROM_PAGES) {
+        size_t offs = (page - ROM_PAGES) << PAGE_SHIFT;
+        data = rom.data() + offs;
+        len = std::min(len, rom.size() - offs);
+    } else if (page >= PALETTE_PAGES) {
+        data = cram.data();
+        len = cram.size();
+    } else if (page >= IO_PAGES) {
+        data = io.data();
+        len = io.size();
+    } else if (page >= OAM_PAGES) {
+        data = oam.data();
+        len = oam.size();
+    } else if (page >= ZRAM_PAGES) {
+        data = zram.data();
+        len = zram.size();
+    } else if (page >= WRAM_PAGES) {
+        data = wram.data() + ((page - WRAM_PAGES) << PAGE_SHIFT);
+    } else if (page >= ERAM_PAGES) {
+        data = eram.data() + ((page - ERAM_PAGES) << PAGE_SHIFT);
+    } else {
+        data = gram.data() + ((page - VRAM_PAGES) << PAGE_SHIFT);
+    }
+
+    // Each page contributes independently, so a changed page is swapped out
+    // of the combined digest without touching the others.
+    uint64_t old_hash = hash_mix(page_hash[page] + page);
+    page_hash[page] = hash_bytes(data, len, page);
+    combined_hash ^= old_hash ^ hash_mix(page_hash[page] + page);
+}
+
+void MMU::map_io(uint8_t reg, IOReader read, IOWriter write, void *context)
+{
+    if (reg == IO_IE) {
+        ie_handler = IOHandler { read, write, context };
+    } else {
+        io_handlers[reg & 0x7f] = IOHandler { read, write, context };
+    }
+}
+
+void MMU::write_io(uint8_t reg, uint8_t value)
+{
+    const IOHandler &handler = io_handlers[reg & 0x7fu];
+    if (handler.write) {
+        handler.write(handler.context, reg & 0x7fu, value);
+    } else {
+        io[reg & 0x7fu] = value;
+    }
+    mark_dirty(IO_PAGES);
+}
+
+void MMU::write_rom(uint16_t addr, uint8_t value)
+{
+    rom[addr] = value;
+    size_t page = addr >> PAGE_SHIFT;
+    mark_dirty(ROM_PAGES + page);
+    rom_written[page >> 6] |= 1ull << (page & 63);
+}
+
+void MMU::save(State &state) const
+{
+    state.rom_pages.clear();
+    for (size_t page = 0; page < WRITABLE_ROM_PAGES; page++) {
+        if (rom_written[page >> 6] & (1ull << (page & 63))) {
+            auto start = rom.begin() + (page << PAGE_SHIFT);
+            state.rom_pages.insert(state.rom_pages.end(), start, start + (1 << PAGE_SHIFT));
+        }
+    }
+    std::copy(std::begin(rom_written), std::end(rom_written), state.rom_written);
+    state.gram = gram;
+    state.eram = eram;
+    state.wram = wram;
+    state.zram = zram;
+    state.oam = oam;
+    state.io = io;
+    state.cram = cram;
+    state.vram_bank = vram_bank;
+    state.wram_bank = wram_bank;
+    state.inbios = inbios;
+    state.double_speed = double_speed;
+    state.dma_lockout = dma_lockout;
+}
+
+void MMU::load(const State &state)
+{
+    // Copy in place: components and the page table hold pointers into
+    // these buffers
+    // Put back the saved ROM pages, and the original of any page first
+    // written after the save
+    auto saved = state.rom_pages.begin();
+    for (size_t page = 0; page < WRITABLE_ROM_PAGES; page++) {
+        uint64_t bit = 1ull << (page & 63);
+        if (state.rom_written[page >> 6] & bit) {
+            std::copy(saved, saved + (1 << PAGE_SHIFT), rom.begin() + (page << PAGE_SHIFT));
+            saved += 1 << PAGE_SHIFT;
+        } else if (rom_written[page >> 6] & bit) {
+            auto original = rom_original.begin() + (page << PAGE_SHIFT);
+            std::copy(original, original + (1 << PAGE_SHIFT), rom.begin() + (page << PAGE_SHIFT));
+        }
+    }
+    std::copy(std::begin(state.rom_written), std::end(state.rom_written), rom_written);
+    std::copy(state.gram.begin(), state.gram.end(), gram.begin());
+    std::copy(state.eram.begin(), state.eram.end(), eram.begin());
+    std::copy(state.wram.begin(), state.wram.end(), wram.begin());
+    std::copy(state.zram.begin(), state.zram.end(), zram.begin());
+    std::copy(state.oam.begin(), state.oam.end(), oam.begin());
+    std::copy(state.io.begin(), state.io.end(), io.begin());
+    std::copy(state.cram.begin(), state.cram.end(), cram.begin());
+    vram_bank = state.vram_bank;
+    wram_bank = state.wram_bank;
+    inbios = state.inbios;
+    double_speed = state.double_speed;
+    dma_lockout = state.dma_lockout;
+
+    map_pages();
+    for (size_t page = 0; page < page_count; page++) {
+        mark_dirty(page);
+    }
+    std::fill(std::begin(dirty_tiles), std::end(dirty_tiles), ~0ull);
+    vram_version++;
+    palette_version++;
+}
+
+uint64_t MMU::ram_hash()
+{
+    for (size_t word = 0; word < dirty_pages.size(); word++) {
+        while (dirty_pages[word]) {
+            size_t bit = __builtin_ctzll(dirty_pages[word]);
+            dirty_pages[word] &= dirty_pages[word] - 1;
+            rehash_page((word << 6) | bit);
+        }
+    }
+    return combined_hash;
+}
+
+void MMU::map_dma(DmaReader reader, void *context)
+{
+    dma_reader = reader;
+    dma_context = context;
+}
+
+bool MMU::dma_blocks(uint16_t addr) const
+{
+    if (addr >= 0xfe00) {
+        // OAM is being written; the I/O registers and HRAM are internal
+        return addr < 0xff00;
+    }
+    // Video RAM has a bus of its own. The cartridge and WRAM share the
+    // external one, except on CGB, which gives WRAM a third.
+    auto bus = [&](unsigned at) {
+        return (at & 0xe000) == 0x8000 ? 0 : cgb && at >= 0xc000 ? 2 : 1;
+    };
+    return bus(addr) == bus(static_cast<unsigned>(io[IO_DMA]) << 8);
 }
 
 uint8_t MMU::rb(uint16_t addr)
 {
+    if (dma_lockout && addr < 0xff00 && dma_blocks(addr)) {
+        return addr < 0xfe00 && dma_reader ? dma_reader(dma_context) : 0xff;
+    }
+
     switch (addr & 0xf000) {
     // ROM 0
     case 0x0000:
@@ -55,7 +371,7 @@ uint8_t MMU::rb(uint16_t addr)
     // Graphics
     case 0x8000:
     case 0x9000:
-        return gram.at(addr & 0x1fffu);
+        return gram.at(vram_bank + (addr & 0x1fffu));
 
     // External RAM
     case 0xa000:
@@ -64,27 +380,28 @@ uint8_t MMU::rb(uint16_t addr)
 
     // Working RAM
     case 0xc000:
+        return wram.at(addr & 0x0fffu);
     case 0xd000:
-        return wram.at(addr & 0x1fffu);
+        return wram.at(wram_bank + (addr & 0x0fffu));
 
     // Working RAM shadow
     case 0xe000:
-        return wram.at(addr & 0x1fffu);
+        return wram.at(addr & 0x0fffu);
     case 0xf000:
         switch (addr & 0x0f00) {
             // Object Attribute memory
             case 0x0e00:
-                return 0;
+                return addr < 0xfea0 ? oam.at(addr & 0xffu) : 0;
             case 0x0f00:
                 if (addr >= 0xff80) {
                     return zram.at(addr & 0x7fu);
                 } else {
-                    // I/O control handling
-                    return 0;
+                    const IOHandler &handler = io_handlers[addr & 0x7fu];
+                    return handler.read ? handler.read(handler.context, addr & 0x7fu) : io[addr & 0x7fu];
                 }
             default:
                 // Working RAM
-                return wram.at(addr & 0x1fffu);
+                return wram.at(wram_bank + (addr & 0x0fffu));
         }
     default:
         throw std::out_of_range("Unexpected access: " + std::to_string(addr));
@@ -101,6 +418,10 @@ uint16_t MMU::rw(uint16_t addr)
 
 void MMU::wb(uint16_t addr, uint8_t value)
 {
+    if (dma_lockout && addr < 0xff00 && dma_blocks(addr)) {
+        return;
+    }
+
     switch (addr & 0xf000) {
     // ROM 0
     case 0x0000:
@@ -112,13 +433,13 @@ void MMU::wb(uint16_t addr, uint8_t value)
                     std::string("Unexpected memory write at ") + std::to_string(addr) + "\n");
             }
         } else {
-            rom.at(addr) = value;
+            write_rom(addr, value);
         }
         break;
     case 0x1000:
     case 0x2000:
     case 0x3000:
-        rom.at(addr) = value;
+        write_rom(addr, value);
         break;
 
     // ROM bank 1
@@ -126,48 +447,59 @@ void MMU::wb(uint16_t addr, uint8_t value)
     case 0x5000:
     case 0x6000:
     case 0x7000:
-        rom.at(addr) = value;
+        write_rom(addr, value);
         break;
 
     // Graphics
     case 0x8000:
     case 0x9000:
-        gram.at(addr & 0x1fffu) = value;
+        gram.at(vram_bank + (addr & 0x1fffu)) = value;
+        mark_vram(vram_bank + (addr & 0x1fffu));
+        vram_version++;
         break;
 
     // External RAM
     case 0xa000:
     case 0xb000:
         eram.at(addr & 0x1fffu) = value;
+        mark_dirty(ERAM_PAGES + ((addr & 0x1fffu) >> PAGE_SHIFT));
         break;
 
     // Working RAM
     case 0xc000:
-    case 0xd000:
-        wram.at(addr & 0x1fffu) = value;
-        break;
-
-    // Working RAM shadow
     case 0xe000:
-        wram.at(addr & 0x1fffu) = value;
+        wram.at(addr & 0x0fffu) = value;
+        mark_dirty(WRAM_PAGES + ((addr & 0x0fffu) >> PAGE_SHIFT));
+        break;
+    case 0xd000:
+        wram.at(wram_bank + (addr & 0x0fffu)) = value;
+        mark_dirty(WRAM_PAGES + ((wram_bank + (addr & 0x0fffu)) >> PAGE_SHIFT));
         break;
 
     case 0xf000:
         switch (addr & 0x0f00) {
             // Object Attribute memory
             case 0x0e00:
-                // unimplemented
+                if (addr < 0xfea0) {
+                    oam.at(addr & 0xffu) = value;
+                    mark_dirty(OAM_PAGES);
+                }
                 break;
             case 0x0f00:
                 if (addr >= 0xff80) {
                     zram.at(addr & 0x7fu) = value;
+                    mark_dirty(ZRAM_PAGES);
+                    if (addr == 0xffff && ie_handler.write) {
+                        ie_handler.write(ie_handler.context, IO_IE, value);
+                    }
                 } else {
-                    // I/O control handling
+                    write_io(addr & 0xffu, value);
                 }
                 break;
             default:
-                // Working RAM
-                wram.at(addr & 0x1fffu) = value;
+                // Working RAM shadow
+                wram.at(wram_bank + (addr & 0x0fffu)) = value;
+                mark_dirty(WRAM_PAGES + ((wram_bank + (addr & 0x0fffu)) >> PAGE_SHIFT));
                 break;
         }
         break;
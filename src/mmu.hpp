@@ -5,25 +5,194 @@
 #ifndef RGB_MMU_HPP
 #define RGB_MMU_HPP
 
+#include <cstddef>
 #include <cstdint>
+#include <string>
 #include <vector>
 
+// Offsets of the I/O registers in 0xff00-0xff7f
+enum IORegister : uint8_t {
+    IO_P1 = 0x00,
+    IO_DIV = 0x04,
+    IO_TIMA = 0x05,
+    IO_TMA = 0x06,
+    IO_TAC = 0x07,
+    IO_IF = 0x0f,
+    IO_LCDC = 0x40,
+    IO_STAT = 0x41,
+    IO_SCY = 0x42,
+    IO_SCX = 0x43,
+    IO_LY = 0x44,
+    IO_LYC = 0x45,
+    IO_DMA = 0x46,
+    IO_BGP = 0x47,
+    IO_OBP0 = 0x48,
+    IO_OBP1 = 0x49,
+    IO_WY = 0x4a,
+    IO_WX = 0x4b,
+    IO_KEY1 = 0x4d,  // CGB only from here on
+    IO_VBK = 0x4f,
+    IO_HDMA1 = 0x51,
+    IO_HDMA2 = 0x52,
+    IO_HDMA3 = 0x53,
+    IO_HDMA4 = 0x54,
+    IO_HDMA5 = 0x55,
+    IO_BCPS = 0x68,
+    IO_BCPD = 0x69,
+    IO_OCPS = 0x6a,
+    IO_OCPD = 0x6b,
+    IO_SVBK = 0x70,
+    IO_IE = 0xff     // at 0xffff, outside the register file
+};
+
 class MMU {
+  public:
+    using IOReader = uint8_t (*)(void *context, uint8_t reg);
+    using IOWriter = void (*)(void *context, uint8_t reg, uint8_t value);
+    using DmaReader = uint8_t (*)(void *context);
+
 private:
     std::vector<uint8_t> rom;
-    std::vector<uint8_t> gram = std::vector<uint8_t>(0x2000);
+    // Two VRAM banks and eight WRAM banks; DMG games only see the first
+    // one and two of them
+    std::vector<uint8_t> gram = std::vector<uint8_t>(0x4000);
     std::vector<uint8_t> eram = std::vector<uint8_t>(0x2000);
-    std::vector<uint8_t> wram = std::vector<uint8_t>(0x2000);
+    std::vector<uint8_t> wram = std::vector<uint8_t>(0x8000);
     std::vector<uint8_t> zram = std::vector<uint8_t>(0x80);
-    void load_rom();
+    std::vector<uint8_t> oam = std::vector<uint8_t>(0xa0);
+    std::vector<uint8_t> io = std::vector<uint8_t>(0x80);
+    // CGB background palettes followed by object palettes, 8 x 4 RGB555
+    // colours each
+    std::vector<uint8_t> cram = std::vector<uint8_t>(0x80);
+
+    // Offsets of the banks mapped at 0x8000 and 0xd000
+    size_t vram_bank;
+    size_t wram_bank;
+
+    // I/O registers without a handler are plain storage in io
+    struct IOHandler {
+        IOReader read;
+        IOWriter write;
+        void *context;
+    };
+    IOHandler io_handlers[0x80];
+    IOHandler ie_handler;
+    DmaReader dma_reader;
+    void *dma_context;
+    // Whether a CPU access to addr conflicts with the OAM DMA transfer
+    bool dma_blocks(uint16_t addr) const;
+
+    // Backing memory for each 256-byte page of the address space that
+    // reads as plain memory, or null where reads need the full decode
+    const uint8_t *read_pages[0x100];
+    void map_pages();
+    void map_cgb_registers();
+    void write_palette(uint8_t spec_reg, size_t base, uint8_t value);
+    void mark_vram(size_t offset);
+
+    // Dirty-page tracking for incremental state hashing. Memory is split
+    // into 256-byte pages; writes mark their page dirty and ram_hash()
+    // rehashes only the pages written since the last call.
+    static constexpr size_t PAGE_SHIFT = 8;
+    static constexpr size_t VRAM_PAGES = 0;
+    static constexpr size_t ERAM_PAGES = 0x40;
+    static constexpr size_t WRAM_PAGES = 0x60;
+    static constexpr size_t ZRAM_PAGES = 0xe0;
+    static constexpr size_t OAM_PAGES = 0xe1;
+    static constexpr size_t IO_PAGES = 0xe2;
+    static constexpr size_t PALETTE_PAGES = 0xe3;
+    static constexpr size_t ROM_PAGES = 0xe4;
+    size_t page_count;
+    std::vector<uint64_t> dirty_pages;
+    std::vector<uint64_t> page_hash;
+    uint64_t combined_hash;
+
+    void mark_dirty(size_t page)
+    {
+        dirty_pages[page >> 6] |= 1ull << (page & 63);
+    }
+
+    // Without an MBC, writes to 0x0000-0x7fff land in the ROM. Save states
+    // carry only the pages written since power on, so they stay O(RAM);
+    // the pages as loaded are kept to undo writes made after a save.
+    static constexpr size_t WRITABLE_ROM_PAGES = 0x80;
+    uint64_t rom_written[WRITABLE_ROM_PAGES / 64];
+    std::vector<uint8_t> rom_original;
+    void write_rom(uint16_t addr, uint8_t value);
+    void init_pages();
+    void rehash_page(size_t page);
 
   public:
-    MMU();
+    // Runs the cartridge in rom, padded to at least 32 KiB
+    explicit MMU(std::vector<uint8_t> rom);
+    // A whole ROM file; throws std::runtime_error if it can't be read
+    static std::vector<uint8_t> read_rom(const std::string &path);
     bool inbios;
+    // Set from the cartridge header; enables the CGB registers
+    bool cgb;
+    // KEY1 speed, switched by STOP. The CPU and timer run twice as fast;
+    // the GPU does not.
+    bool double_speed;
+
+    // Tiles in 0x8000-0x97ff written since the GPU last decoded them, the
+    // second VRAM bank's from TILE_COUNT / 2 on
+    static constexpr size_t TILE_COUNT = 768;
+    uint64_t dirty_tiles[TILE_COUNT / 64];
+    // Bumped on every VRAM write
+    uint32_t vram_version;
+    // Bumped on every CGB palette write
+    uint32_t palette_version;
+    // Both banks, 0x2000 bytes each
+    const uint8_t *vram() const { return gram.data(); }
+    size_t vram_size() const { return cgb ? 0x4000 : 0x2000; }
+    const uint8_t *palette_data() const { return cram.data(); }
+    const uint8_t *oam_data() const { return oam.data(); }
+
+    // Set while an OAM DMA transfer owns the bus its source is on. CPU
+    // reads on that bus see the byte being transferred instead, as on
+    // hardware, and writes there are dropped; the other bus, 0xff00-0xffff
+    // and nothing in OAM stay reachable.
+    bool dma_lockout;
+    // Give the byte the transfer is on, for reads that conflict with it
+    void map_dma(DmaReader reader, void *context);
+    // Copy the 160 bytes at page << 8 into OAM in one go
+    void oam_dma(uint8_t page);
+    // Copy len bytes from addr into the current VRAM bank at offset, for
+    // HDMA. The source is read a page at a time.
+    void vram_dma(uint16_t offset, uint16_t addr, size_t len);
+    // STOP: toggle double speed if KEY1 armed it
+    bool switch_speed();
+    uint8_t *io_registers() { return io.data(); }
+
+    // Route reads and/or writes of one I/O register through a callback.
+    // A null read or write keeps that direction as plain storage. IO_IE
+    // only supports a write callback, which runs after the byte is stored.
+    void map_io(uint8_t reg, IOReader read, IOWriter write, void *context);
+    // Write an I/O register as the CPU would, for components raising flags
+    void write_io(uint8_t reg, uint8_t value);
+
     uint8_t rb(uint16_t addr);
     uint16_t rw(uint16_t addr);
     void wb(uint16_t addr, uint8_t value);
     void ww(uint16_t addr, uint16_t value);
+
+    // 64-bit digest of all memory contents, in O(dirty pages)
+    uint64_t ram_hash();
+
+    // Memory and banking state for save states. Saving into the same
+    // State again reuses its buffers, so repeated saves don't allocate.
+    struct State {
+        // The ROM pages written since power on, in page order
+        std::vector<uint8_t> rom_pages;
+        uint64_t rom_written[WRITABLE_ROM_PAGES / 64];
+        std::vector<uint8_t> gram, eram, wram, zram, oam, io, cram;
+        size_t vram_bank, wram_bank;
+        bool inbios, double_speed, dma_lockout;
+    };
+    void save(State &state) const;
+    // Everything derived from memory (page table, page hashes, tile
+    // cache) is marked stale rather than saved
+    void load(const State &state);
 };
 
 #endif //RGB_MMU_HPP
@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__linux__)
+#include <dirent.h>
+#endif
+#include "util/live_stats.hpp"
+
+// Watches emulators started with rgb --stats through their shared memory
+// segments, printing their rates once per interval. Reading takes nothing
+// from the emulators: no signals, no locks, no waiting on either side.
+//
+//   rgb_monitor [pid...] [--interval SECONDS] [--count N]
+//
+// With no pids, every rgb segment in /dev/shm is watched, including ones
+// that appear later.
+
+namespace {
+
+struct Instance {
+    std::unique_ptr<LiveStatsReader> reader;
+    LiveStatsSample last;
+    // Whether last is a consistent reading to take rates from
+    bool valid;
+};
+
+// Segment names of running emulators
+std::vector<std::string> find_segments()
+{
+    std::vector<std::string> names;
+#if defined(__linux__)
+    if (DIR *dir = opendir("/dev/shm")) {
+        while (dirent *entry = readdir(dir)) {
+            if (std::strncmp(entry->d_name, "rgb-", 4) == 0) {
+                names.push_back(std::string("/") + entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
+#endif
+    return names;
+}
+
+// Rates between two samples of the same emulator, as one table row
+void print_row(uint32_t pid, const LiveStatsSample &from, const LiveStatsSample &to)
+{
+    uint64_t frames = to.frames - from.frames;
+    double seconds = (to.time_ns - from.time_ns) / 1e9;
+    uint64_t cycles = to.cycles - from.cycles;
+    char row[128];
+    if (frames == 0 || seconds <= 0) {
+        std::snprintf(row, sizeof(row), "%8u %8s %9s %7s %7s %10llu", pid, "stalled", "-", "-", "-",
+                      (unsigned long long) to.audio_underruns);
+    } else {
+        std::snprintf(row, sizeof(row), "%8u %8.2f %9.3f %7.2f %7.1f %10llu", pid, frames / seconds,
+                      (to.busy_ns - from.busy_ns) / 1e6 / frames,
+                      (to.instructions - from.instructions) / seconds / 1e6,
+                      cycles ? 100.0 * (to.idle_cycles - from.idle_cycles) / cycles : 0.0,
+                      (unsigned long long) to.audio_underruns);
+    }
+    std::cout << row << "\n";
+}
+
+// A row with no rates, only a word on why
+void print_status(uint32_t pid, const char *status)
+{
+    char row[128];
+    std::snprintf(row, sizeof(row), "%8u %8s %9s %7s %7s %10s", pid, status, "-", "-", "-", "-");
+    std::cout << row << "\n";
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> names;
+    double interval = 1;
+    long count = -1;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            interval = std::max(0.05, std::atof(argv[++i]));
+        } else if (std::strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            count = std::max(1L, std::atol(argv[++i]));
+        } else if (argv[i][0] != '-') {
+            names.push_back(live_stats_name(argv[i]));
+        } else {
+            std::cerr << "usage: rgb_monitor [pid...] [--interval SECONDS] [--count N]\n";
+            return 2;
+        }
+    }
+    bool scan = names.empty();
+
+    std::map<std::string, Instance> instances;
+    auto attach = [&](const std::string &name) {
+        try {
+            Instance instance;
+            instance.reader.reset(new LiveStatsReader(name));
+            instance.valid = instance.reader->read(instance.last);
+            instances[name] = std::move(instance);
+        } catch (const std::exception &e) {
+            if (!scan) {
+                std::cerr << e.what() << "\n";
+            }
+        }
+    };
+    for (const std::string &name : names) {
+        attach(name);
+    }
+    if (!scan && instances.empty()) {
+        return 1;
+    }
+
+    for (long pass = 0; count < 0 || pass < count; pass++) {
+        if (scan) {
+            // Emulators that exited have removed their segments
+            std::vector<std::string> found = find_segments();
+            for (auto it = instances.begin(); it != instances.end();) {
+                bool present = false;
+                for (const std::string &name : found) {
+                    present = present || name == it->first;
+                }
+                it = present ? std::next(it) : instances.erase(it);
+            }
+            for (const std::string &name : found) {
+                if (!instances.count(name)) {
+                    attach(name);
+                }
+            }
+        }
+
+        std::this_thread::sleep_for(std::chrono::duration<double>(interval));
+        std::cout << "     pid      fps  ms/frame    MIPS  idle %  underruns\n";
+        for (auto &entry : instances) {
+            Instance &instance = entry.second;
+            LiveStatsSample now;
+            if (!instance.reader->read(now)) {
+                // Left mid-update by an emulator that died or is stopped
+                print_status(instance.reader->pid(), "stale");
+                instance.valid = false;
+                continue;
+            }
+            if (instance.valid) {
+                print_row(instance.reader->pid(), instance.last, now);
+            } else {
+                print_status(instance.reader->pid(), "resumed");
+            }
+            instance.last = now;
+            instance.valid = true;
+        }
+        std::cout << std::flush;
+    }
+    return 0;
+}
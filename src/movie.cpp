@@ -0,0 +1,353 @@
+#ifndef RGB_MOVIE_CPP
+#define RGB_MOVIE_CPP
+
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "machine.cpp"
+
+// Input recording: the buttons held for each frame from a known start,
+// with digests of the machine state at checkpoints to verify a replay.
+//
+// File layout, in host byte order:
+//   "RGBMOVIE", u32 version, u64 ROM hash
+//   u8 start (0 power on, 1 save state), u64 hash of the starting state
+//   for a save state: u32 snapshot size, then the snapshot
+//   u32 frames, one button byte per frame
+//   u32 checkpoints, each u32 frame and u64 RGB::state_hash()
+//   u64 hash of the state at the end
+//
+// An embedded save state is the in-memory snapshot written out as is, so
+// it only loads into the build that wrote it; the snapshot size is checked
+// as a guard. Movies from power on don't have this restriction. rgb
+// --record starts from power on, and with --record-after N from the state
+// after N frames.
+class Movie {
+  public:
+    struct Checkpoint {
+        uint32_t frame;
+        uint64_t hash;
+    };
+
+    uint64_t rom_hash = 0;
+    // Null for a movie from power on
+    std::unique_ptr<RGB::Snapshot> start_state;
+    uint64_t start_hash = 0;
+    // Buttons held during each frame
+    std::vector<uint8_t> inputs;
+    // State after the given number of frames, in frame order
+    std::vector<Checkpoint> checkpoints;
+    // State where recording stopped, which may be partway into the last
+    // frame if the CPU stopped
+    uint64_t end_hash = 0;
+
+    static constexpr uint32_t VERSION = 1;
+
+    static uint64_t hash_rom(const std::vector<uint8_t> &rom) {
+        return hash_bytes(rom.data(), rom.size());
+    }
+
+    // Start from the machine as it is, which must be at power on unless
+    // the state is embedded
+    void begin(RGB &rgb, uint64_t rom, bool embed_state) {
+        rom_hash = rom;
+        start_state.reset();
+        if (embed_state) {
+            start_state.reset(new RGB::Snapshot());
+            rgb.save_state(*start_state);
+        }
+        start_hash = rgb.state_hash();
+        inputs.clear();
+        checkpoints.clear();
+    }
+
+    void save(const std::string &path) const {
+        std::ofstream out(path, std::ios::binary);
+        out.write(MAGIC, sizeof(MAGIC));
+        write_raw(out, VERSION);
+        write_raw(out, rom_hash);
+        write_raw(out, static_cast<uint8_t>(start_state ? 1 : 0));
+        write_raw(out, start_hash);
+        if (start_state) {
+            write_raw(out, static_cast<uint32_t>(sizeof(RGB::Snapshot)));
+            write_snapshot(out, *start_state);
+        }
+        write_raw(out, static_cast<uint32_t>(inputs.size()));
+        out.write(reinterpret_cast<const char *>(inputs.data()), inputs.size());
+        write_raw(out, static_cast<uint32_t>(checkpoints.size()));
+        for (const Checkpoint &checkpoint : checkpoints) {
+            write_raw(out, checkpoint.frame);
+            write_raw(out, checkpoint.hash);
+        }
+        write_raw(out, end_hash);
+        if (!out) {
+            throw std::runtime_error("Can't write movie " + path);
+        }
+    }
+
+    static Movie load(const std::string &path) {
+        std::ifstream in(path, std::ios::binary);
+        Movie movie;
+        char magic[sizeof(MAGIC)];
+        in.read(magic, sizeof(magic));
+        if (!in || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || read_raw<uint32_t>(in) != VERSION) {
+            throw std::runtime_error("Not a movie " + path);
+        }
+        movie.rom_hash = read_raw<uint64_t>(in);
+        bool from_state = read_raw<uint8_t>(in) != 0;
+        movie.start_hash = read_raw<uint64_t>(in);
+        if (from_state) {
+            if (read_raw<uint32_t>(in) != sizeof(RGB::Snapshot)) {
+                throw std::runtime_error("Movie " + path + " has a save state from another build");
+            }
+            movie.start_state.reset(new RGB::Snapshot());
+            read_snapshot(in, *movie.start_state);
+        }
+        movie.inputs.resize(read_raw<uint32_t>(in));
+        in.read(reinterpret_cast<char *>(movie.inputs.data()), movie.inputs.size());
+        movie.checkpoints.resize(read_raw<uint32_t>(in));
+        for (Checkpoint &checkpoint : movie.checkpoints) {
+            checkpoint.frame = read_raw<uint32_t>(in);
+            checkpoint.hash = read_raw<uint64_t>(in);
+        }
+        movie.end_hash = read_raw<uint64_t>(in);
+        if (!in) {
+            throw std::runtime_error("Truncated movie " + path);
+        }
+        return movie;
+    }
+
+  private:
+    static constexpr char MAGIC[8] = { 'R', 'G', 'B', 'M', 'O', 'V', 'I', 'E' };
+
+    template <class T>
+    static void write_raw(std::ostream &out, const T &value) {
+        static_assert(std::is_trivially_copyable<T>::value, "written as bytes");
+        out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    template <class T>
+    static T read_raw(std::istream &in) {
+        static_assert(std::is_trivially_copyable<T>::value, "read as bytes");
+        T value{};
+        in.read(reinterpret_cast<char *>(&value), sizeof(T));
+        return value;
+    }
+
+    template <class T>
+    static void read_raw(std::istream &in, T &value) {
+        value = read_raw<T>(in);
+    }
+
+    static void write_bytes(std::ostream &out, const std::vector<uint8_t> &bytes) {
+        write_raw(out, static_cast<uint32_t>(bytes.size()));
+        out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    }
+
+    static void read_bytes(std::istream &in, std::vector<uint8_t> &bytes) {
+        bytes.resize(read_raw<uint32_t>(in));
+        in.read(reinterpret_cast<char *>(bytes.data()), bytes.size());
+    }
+
+    static void write_snapshot(std::ostream &out, const RGB::Snapshot &state) {
+        const MMU::State &mmu = state.mmu;
+        for (const std::vector<uint8_t> *bytes :
+             { &mmu.rom_pages, &mmu.gram, &mmu.eram, &mmu.wram, &mmu.zram, &mmu.oam, &mmu.io, &mmu.cram }) {
+            write_bytes(out, *bytes);
+        }
+        for (uint64_t word : mmu.rom_written) {
+            write_raw(out, word);
+        }
+        write_raw(out, mmu.vram_bank);
+        write_raw(out, mmu.wram_bank);
+        write_raw(out, mmu.inbios);
+        write_raw(out, mmu.double_speed);
+        write_raw(out, mmu.dma_lockout);
+        write_raw(out, state.scheduler);
+        write_raw(out, state.reg);
+        write_raw(out, state.clock);
+        write_raw(out, state.halt);
+        write_raw(out, state.stop);
+        write_raw(out, state.interrupts);
+        write_raw(out, state.hdma);
+        write_raw(out, state.gpu);
+        write_raw(out, state.joypad);
+        write_raw(out, state.timer);
+        write_raw(out, state.apu);
+        write_raw(out, state.gpu_clock);
+        write_raw(out, state.idle_cycles);
+        write_raw(out, state.retired);
+        write_raw(out, state.frames_done);
+    }
+
+    static void read_snapshot(std::istream &in, RGB::Snapshot &state) {
+        MMU::State &mmu = state.mmu;
+        for (std::vector<uint8_t> *bytes :
+             { &mmu.rom_pages, &mmu.gram, &mmu.eram, &mmu.wram, &mmu.zram, &mmu.oam, &mmu.io, &mmu.cram }) {
+            read_bytes(in, *bytes);
+        }
+        for (uint64_t &word : mmu.rom_written) {
+            read_raw(in, word);
+        }
+        read_raw(in, mmu.vram_bank);
+        read_raw(in, mmu.wram_bank);
+        read_raw(in, mmu.inbios);
+        read_raw(in, mmu.double_speed);
+        read_raw(in, mmu.dma_lockout);
+        read_raw(in, state.scheduler);
+        read_raw(in, state.reg);
+        read_raw(in, state.clock);
+        read_raw(in, state.halt);
+        read_raw(in, state.stop);
+        read_raw(in, state.interrupts);
+        read_raw(in, state.hdma);
+        read_raw(in, state.gpu);
+        read_raw(in, state.joypad);
+        read_raw(in, state.timer);
+        read_raw(in, state.apu);
+        read_raw(in, state.gpu_clock);
+        read_raw(in, state.idle_cycles);
+        read_raw(in, state.retired);
+        read_raw(in, state.frames_done);
+    }
+};
+
+constexpr uint32_t Movie::VERSION;
+constexpr char Movie::MAGIC[8];
+
+// Wraps a frontend for RGB::run_loop and records the buttons it hands the
+// machine, with a checkpoint every interval frames. Recording starts
+// right away, from the machine movie.begin() saw, or once after frames
+// have been presented, from a save state of that point.
+template <class Frontend>
+class MovieRecorder {
+  private:
+    Frontend &frontend;
+    RGB &rgb;
+    Movie &movie;
+    uint32_t interval;
+    uint64_t start_frame;
+    bool recording;
+
+    uint32_t frame_number() const {
+        return static_cast<uint32_t>(rgb.frames() - start_frame);
+    }
+
+  public:
+    MovieRecorder(Frontend &_frontend, RGB &_rgb, Movie &_movie, uint32_t _interval, uint32_t after = 0)
+        : frontend(_frontend), rgb(_rgb), movie(_movie), interval(std::max<uint32_t>(1, _interval)),
+          start_frame(_rgb.frames() + after), recording(after == 0) {
+        if (recording) {
+            // The first frame runs with whatever is held now
+            movie.inputs.push_back(rgb.buttons());
+        }
+    }
+
+    bool present(const Framebuffer &frame) {
+        if (!recording) {
+            if (rgb.frames() == start_frame) {
+                // Between frames, so the next buttons() is the first input
+                movie.begin(rgb, movie.rom_hash, true);
+                recording = true;
+            }
+        } else if (frame_number() % interval == 0) {
+            movie.checkpoints.push_back({ frame_number(), rgb.state_hash() });
+        }
+        return frontend.present(frame);
+    }
+
+    double resample_rate() {
+        return frontend.resample_rate();
+    }
+
+    uint8_t buttons() {
+        uint8_t buttons = frontend.buttons();
+        if (recording) {
+            movie.inputs.push_back(buttons);
+        }
+        return buttons;
+    }
+
+    // False if run_loop() ended before recording started
+    bool started() const {
+        return recording;
+    }
+
+    // After run_loop returns. If the CPU stopped, the last input is for
+    // the frame it stopped in, which replay runs the same way.
+    void finish() {
+        movie.end_hash = rgb.state_hash();
+    }
+};
+
+// Play a movie back on a freshly built machine as fast as possible. Stops
+// at the first checkpoint that doesn't match.
+class MoviePlayer {
+  public:
+    struct Result {
+        uint32_t frames = 0;
+        size_t checkpoints_passed = 0;
+        // Set when a checkpoint or the end state failed; the start state
+        // counts as frame 0
+        bool diverged = false;
+        uint32_t diverged_frame = 0;
+        uint64_t expected = 0, actual = 0;
+    };
+
+    // Drawing is turned off, as nothing looks at the frames
+    static Result play(RGB &rgb, const Movie &movie) {
+        rgb.set_rendering(false);
+        return play(rgb, movie, [](const Framebuffer &) {});
+    }
+
+    // Hands each completed frame to on_frame, drawn as usual
+    template <class OnFrame>
+    static Result play(RGB &rgb, const Movie &movie, OnFrame &&on_frame) {
+        Result result;
+        if (movie.start_state) {
+            rgb.load_state(*movie.start_state);
+        }
+        uint64_t start_frame = rgb.frames();
+        if (!check(rgb, 0, movie.start_hash, result)) {
+            return result;
+        }
+
+        auto checkpoint = movie.checkpoints.begin();
+        for (uint8_t buttons : movie.inputs) {
+            rgb.set_buttons(buttons);
+            if (!rgb.run_frame()) {
+                break;
+            }
+            result.frames = static_cast<uint32_t>(rgb.frames() - start_frame);
+            on_frame(rgb.frame());
+            if (checkpoint != movie.checkpoints.end() && checkpoint->frame == result.frames) {
+                if (!check(rgb, result.frames, checkpoint->hash, result)) {
+                    return result;
+                }
+                result.checkpoints_passed++;
+                ++checkpoint;
+            }
+        }
+        check(rgb, result.frames, movie.end_hash, result);
+        return result;
+    }
+
+  private:
+    static bool check(RGB &rgb, uint32_t frame, uint64_t expected, Result &result) {
+        uint64_t actual = rgb.state_hash();
+        if (actual == expected) {
+            return true;
+        }
+        result.diverged = true;
+        result.diverged_frame = frame;
+        result.expected = expected;
+        result.actual = actual;
+        return false;
+    }
+};
+
+#endif //RGB_MOVIE_CPP
@@ -0,0 +1,157 @@
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "assembler.cpp"
+#include "z80.cpp"
+
+// Checks the opcode table in opcodes.cpp against everything that uses it
+// and against the CPU, which has its own switch. Every opcode, 0xcb ones
+// included, is written out in the table's notation and must:
+//   - assemble to itself with the table's length
+//   - disassemble back to the same text
+//   - leave PC just past it when the CPU executes it, unless it can branch
+// and the opcodes missing from the table must be unknown to the CPU.
+// Prints each disagreement and exits non-zero if there are any. Entries
+// the CPU doesn't implement yet are listed too, but don't fail the check.
+//
+//   rgb_opcheck
+
+namespace {
+
+// Assembled at ORG, executed from WRAM with the pointer registers aimed at
+// WRAM too, so loads and stores through them are harmless
+constexpr uint16_t ORG = 0x0200;
+constexpr uint16_t EXEC_AT = 0xc000;
+
+// The table's notation with the operand filled in as disassemble() writes it
+std::string instance(const std::string &mnemonic)
+{
+    std::string text = mnemonic;
+    char value[8];
+    size_t at;
+    if ((at = text.find("d16")) != std::string::npos || (at = text.find("a16")) != std::string::npos) {
+        std::snprintf(value, sizeof(value), "$%04x", 0xc123);
+    } else if ((at = text.find("a8")) != std::string::npos) {
+        std::snprintf(value, sizeof(value), "$%02x", 0x80);
+    } else if ((at = text.find("d8")) != std::string::npos) {
+        std::snprintf(value, sizeof(value), "$%02x", 0x42);
+    } else if ((at = text.find("r8")) != std::string::npos) {
+        if (text.compare(0, 2, "JR") == 0) {
+            std::snprintf(value, sizeof(value), "$%04x", ORG + 2 + 5);
+        } else {
+            std::snprintf(value, sizeof(value), "%d", 5);
+        }
+    } else {
+        return text;
+    }
+    return text.replace(at, text[at + 1] == '1' ? 3 : 2, value);
+}
+
+struct Result {
+    bool known;
+    uint16_t pc;
+};
+
+// Execute one instruction from EXEC_AT on a fresh CPU
+Result execute(const uint8_t *bytes, size_t length)
+{
+    MMU mmu(std::vector<uint8_t>(0x8000));
+    mmu.inbios = false;
+    Z80 z80(mmu);
+    z80.post_boot(false);
+    for (size_t i = 0; i < length; i++) {
+        mmu.wb(static_cast<uint16_t>(EXEC_AT + i), bytes[i]);
+    }
+    z80.reg.b = 0xc1;
+    z80.reg.c = 0x10;
+    z80.reg.d = 0xc1;
+    z80.reg.e = 0x20;
+    z80.reg.h = 0xc1;
+    z80.reg.l = 0x30;
+    z80.reg.sp = 0xdff0;
+    z80.reg.pc = EXEC_AT;
+    // panic() explains itself on stderr; only the verdict is wanted
+    std::streambuf *saved = std::cerr.rdbuf(nullptr);
+    z80.exec();
+    std::cerr.rdbuf(saved);
+    return { !z80.stop, z80.reg.pc };
+}
+
+}
+
+int main()
+{
+    int failures = 0;
+    auto fail = [&](const std::string &what, const std::string &problem) {
+        std::cout << what << ": " << problem << "\n";
+        failures++;
+    };
+    auto hex = [](int value) {
+        char text[8];
+        std::snprintf(text, sizeof(text), "%02x", value);
+        return std::string(text);
+    };
+
+    int checked = 0, unimplemented = 0;
+    for (int prefix = 0; prefix < 2; prefix++) {
+        for (int op = 0; op < 256; op++) {
+            std::string name = prefix ? "cb " + hex(op) : hex(op);
+            const char *mnemonic = prefix ? cb_mnemonics()[op].c_str() : OPCODES[op].mnemonic;
+            size_t length = prefix ? 2 : OPCODES[op].length;
+            // STOP is 0x10 0x00
+            uint8_t bytes[3] = { static_cast<uint8_t>(prefix ? 0xcb : op), static_cast<uint8_t>(op), 0 };
+
+            if (!prefix && op == 0xcb) {
+                // The prefix itself, checked as the second table
+                continue;
+            }
+            if (!mnemonic) {
+                if (execute(bytes, 1).known) {
+                    fail(name, "not in the table, but the CPU executes it");
+                }
+                continue;
+            }
+            checked++;
+            std::string text = instance(mnemonic);
+
+            std::vector<uint8_t> rom;
+            try {
+                Assembler as;
+                as("ORG $" + hex(ORG >> 8) + hex(ORG & 0xff))(text);
+                rom = as.rom();
+            } catch (const std::exception &e) {
+                fail(name, "\"" + text + "\" doesn't assemble: " + e.what());
+                continue;
+            }
+            const uint8_t *encoded = rom.data() + ORG;
+            if (encoded[0] != bytes[0] || (prefix && encoded[1] != op)) {
+                fail(name, "\"" + text + "\" assembles to " + hex(encoded[0]) + " " + hex(encoded[1]));
+                continue;
+            }
+            if (ORG + length < rom.size() && rom[ORG + length] != 0xff && op != 0x10) {
+                fail(name, "\"" + text + "\" assembles to more than " + std::to_string(length) + " bytes");
+            }
+
+            std::string back = disassemble(encoded, ORG);
+            if (back != text) {
+                fail(name, "\"" + text + "\" disassembles as \"" + back + "\"");
+            }
+
+            Result result = execute(encoded, length);
+            bool branches = !prefix && ends_block(static_cast<uint8_t>(op));
+            if (!result.known && !(op == 0x10 && !prefix)) {
+                std::cout << name << ": \"" << text << "\" isn't implemented by the CPU\n";
+                unimplemented++;
+            } else if (!branches && result.pc != EXEC_AT + length) {
+                fail(name, "\"" + text + "\" is " + std::to_string(length) + " bytes in the table, but the CPU took "
+                     + std::to_string(result.pc - EXEC_AT));
+            }
+        }
+    }
+
+    std::cout << checked << " opcodes checked, " << failures << " disagreements, " << unimplemented
+              << " not implemented by the CPU\n";
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,323 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <SDL.h>
+#include "apu.cpp"
+#include "framebuffer.cpp"
+#include "joypad.cpp"
+#include "util/trace.hpp"
+
+// Shows completed frames in an SDL2 window. Each frame is uploaded once
+// into a streaming texture and scaled to the window by the renderer; the
+// window, renderer and texture are created once in init(), so the steady
+// state allocates nothing. Audio is pulled from the APU's ring by SDL's
+// callback thread.
+class Presenter {
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    SDL_Window *window = nullptr;
+    SDL_Renderer *renderer = nullptr;
+    SDL_Texture *texture = nullptr;
+    PixelFormat texture_format = PixelFormat::RGBA8888;
+
+    AudioRing *audio = nullptr;
+    SDL_AudioDeviceID audio_device = 0;
+    int audio_rate = 48000;
+    StereoFrame last_sample = {};
+    std::atomic<uint64_t> underruns{0};
+
+    // With audio playing, frames are paced by the device draining the ring
+    // rather than by a timer. The callback signals each time it pops.
+    std::mutex audio_lock;
+    std::condition_variable audio_drained;
+    // Ring level to hold, in samples: two frames' worth
+    size_t audio_target = 0;
+    // Resampling adjustment from the last frame, within +-MAX_RATE_ADJUST
+    double rate_adjust = 1.0;
+
+    uint8_t held = 0;
+
+    int scale = 4;
+    bool software = false;
+    bool capped = true;
+    Clock::duration frame_period;
+    Clock::time_point next_frame;
+
+    static Uint32 sdl_format(PixelFormat format) {
+        return format == PixelFormat::RGB565 ? SDL_PIXELFORMAT_RGB565 : SDL_PIXELFORMAT_RGBA8888;
+    }
+
+    bool create_texture(PixelFormat format) {
+        if (texture) {
+            SDL_DestroyTexture(texture);
+        }
+        texture = SDL_CreateTexture(renderer, sdl_format(format), SDL_TEXTUREACCESS_STREAMING,
+                                    Framebuffer::WIDTH, Framebuffer::HEIGHT);
+        texture_format = format;
+        return texture != NULL;
+    }
+
+    // Runs on SDL's audio thread. Never waits for the emulator: a short
+    // ring is padded by holding the last sample.
+    static void fill_audio(void *context, Uint8 *stream, int len) {
+        RGB_TRACE_THREAD_NAME("audio");
+        RGB_TRACE_SCOPE("audio callback");
+        auto *presenter = static_cast<Presenter *>(context);
+        auto *out = reinterpret_cast<StereoFrame *>(stream);
+        size_t wanted = len / sizeof(StereoFrame);
+        size_t got = presenter->audio->pop(out, wanted);
+        if (got > 0) {
+            presenter->last_sample = out[got - 1];
+        }
+        if (got < wanted) {
+            presenter->underruns.fetch_add(1, std::memory_order_relaxed);
+            std::fill(out + got, out + wanted, presenter->last_sample);
+        }
+        {
+            std::lock_guard<std::mutex> guard(presenter->audio_lock);
+        }
+        presenter->audio_drained.notify_one();
+    }
+
+    void init_audio() {
+        if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+            return;
+        }
+        SDL_AudioSpec want = {}, have;
+        want.freq = audio_rate;
+        want.format = AUDIO_S16SYS;
+        want.channels = 2;
+        // Small device buffer, so the ring can stay within two frames
+        want.samples = 512;
+        want.callback = fill_audio;
+        want.userdata = this;
+        audio_device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+        if (audio_device == 0) {
+            SDL_QuitSubSystem(SDL_INIT_AUDIO);
+            return;
+        }
+        audio_rate = have.freq;
+        audio_target = static_cast<size_t>(2 * audio_rate / REFRESH_RATE);
+        SDL_PauseAudioDevice(audio_device, 0);
+    }
+
+  public:
+    // 4194304 Hz / 70224 cycles per frame
+    static constexpr double REFRESH_RATE = 59.7275;
+    static constexpr double MAX_RATE_ADJUST = 0.005;
+
+    Presenter() {
+        frame_period = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(1.0 / REFRESH_RATE));
+    }
+
+    ~Presenter() {
+        if (audio_device) {
+            SDL_CloseAudioDevice(audio_device);
+            SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        }
+        if (texture) {
+            SDL_DestroyTexture(texture);
+        }
+        if (renderer) {
+            SDL_DestroyRenderer(renderer);
+        }
+        if (window) {
+            SDL_DestroyWindow(window);
+            SDL_QuitSubSystem(SDL_INIT_VIDEO);
+        }
+    }
+
+    Presenter(const Presenter &) = delete;
+    Presenter &operator=(const Presenter &) = delete;
+
+    // Window size as a multiple of the native 160x144
+    void set_scale(int value) {
+        scale = value;
+    }
+
+    // Skip the accelerated renderer and use SDL's software one
+    void set_software(bool value) {
+        software = value;
+    }
+
+    // Run at the emulated refresh rate, or as fast as possible
+    void set_capped(bool value) {
+        capped = value;
+        next_frame = Clock::now();
+    }
+
+    // Play samples from ring; set before init(). Without it, or if the
+    // audio device can't be opened, the emulator runs silent.
+    void set_audio(AudioRing *ring) {
+        audio = ring;
+    }
+
+    // The device's sample rate, valid after init()
+    int sample_rate() const {
+        return audio_rate;
+    }
+
+    // Rate the emulator should resample to for the next frame: the device
+    // rate nudged to keep the ring near its target level
+    double resample_rate() const {
+        return audio_rate * rate_adjust;
+    }
+
+    // Audio callbacks that found the ring short
+    uint64_t audio_underruns() const {
+        return underruns.load(std::memory_order_relaxed);
+    }
+
+    bool init() {
+        if (SDL_InitSubSystem(SDL_INIT_VIDEO) < 0) {
+            return false;
+        }
+
+        window = SDL_CreateWindow("rgb", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                                  Framebuffer::WIDTH * scale, Framebuffer::HEIGHT * scale,
+                                  SDL_WINDOW_RESIZABLE);
+        if (window == NULL) {
+            return false;
+        }
+
+        if (!software) {
+            renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+        }
+        if (renderer == NULL) {
+            renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+        }
+        if (renderer == NULL) {
+            return false;
+        }
+
+        // Nearest-neighbour scaling, letterboxed to the native aspect ratio
+        SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
+        SDL_RenderSetLogicalSize(renderer, Framebuffer::WIDTH, Framebuffer::HEIGHT);
+
+        next_frame = Clock::now();
+        if (audio) {
+            init_audio();
+        }
+        return create_texture(texture_format);
+    }
+
+    // Buttons currently held on the keyboard, as Button bits
+    uint8_t buttons() const {
+        return held;
+    }
+
+    // Show a completed frame. Called once per emulated VBlank; returns
+    // false once the window has been closed.
+    bool present(const Framebuffer &frame) {
+        PixelFormat format = frame.format() == PixelFormat::RGB565 ? PixelFormat::RGB565 : PixelFormat::RGBA8888;
+        if (format != texture_format && !create_texture(format)) {
+            return false;
+        }
+
+        void *pixels;
+        int pitch;
+        if (SDL_LockTexture(texture, NULL, &pixels, &pitch) == 0) {
+            if (frame.format() == texture_format) {
+                if (pitch == frame.pitch()) {
+                    std::memcpy(pixels, frame.pixels(), frame.pitch() * Framebuffer::HEIGHT);
+                } else {
+                    for (int y = 0; y < Framebuffer::HEIGHT; y++) {
+                        std::memcpy((uint8_t *) pixels + y * pitch,
+                                    frame.pixels() + y * frame.pitch(), frame.pitch());
+                    }
+                }
+            } else {
+                // 8-bit grey has no matching texture format; expand it
+                for (int y = 0; y < Framebuffer::HEIGHT; y++) {
+                    auto *row = reinterpret_cast<uint32_t *>((uint8_t *) pixels + y * pitch);
+                    const uint8_t *grey = frame.pixels() + y * frame.pitch();
+                    for (int x = 0; x < Framebuffer::WIDTH; x++) {
+                        row[x] = (uint32_t) grey[x] * 0x01010100u | 0xff;
+                    }
+                }
+            }
+            SDL_UnlockTexture(texture);
+        }
+
+        SDL_RenderClear(renderer);
+        SDL_RenderCopy(renderer, texture, NULL, NULL);
+        SDL_RenderPresent(renderer);
+
+        if (capped) {
+            pace();
+        }
+        return poll_events();
+    }
+
+  private:
+    void pace() {
+        if (audio_device) {
+            pace_audio();
+            return;
+        }
+        next_frame += frame_period;
+        Clock::time_point now = Clock::now();
+        if (next_frame > now) {
+            std::this_thread::sleep_until(next_frame);
+        } else if (now - next_frame > frame_period) {
+            // Fell more than a frame behind; don't try to catch up
+            next_frame = now;
+        }
+    }
+
+    // Steer the resampling ratio towards a ring three quarters full just
+    // after a frame's samples went in, then wait until the device has
+    // drained room for the next frame. The emulator is thereby slaved to the
+    // audio clock, with no sleeping or polling.
+    void pace_audio() {
+        double frame_samples = audio_rate / REFRESH_RATE;
+        double fill = static_cast<double>(audio->size());
+        double error = (audio_target * 0.75 - fill) / (audio_target * 0.25);
+        rate_adjust = 1.0 + MAX_RATE_ADJUST * std::max(-1.0, std::min(1.0, error));
+
+        size_t room = static_cast<size_t>(audio_target - frame_samples);
+        std::unique_lock<std::mutex> guard(audio_lock);
+        // The timeout only matters if the device stops pulling
+        audio_drained.wait_for(guard, std::chrono::milliseconds(100), [&] {
+            return audio->size() <= room;
+        });
+    }
+
+    static uint8_t button_for(SDL_Keycode key) {
+        switch (key) {
+        case SDLK_RIGHT: return BUTTON_RIGHT;
+        case SDLK_LEFT: return BUTTON_LEFT;
+        case SDLK_UP: return BUTTON_UP;
+        case SDLK_DOWN: return BUTTON_DOWN;
+        case SDLK_x: return BUTTON_A;
+        case SDLK_z: return BUTTON_B;
+        case SDLK_BACKSPACE: return BUTTON_SELECT;
+        case SDLK_RETURN: return BUTTON_START;
+        default: return 0;
+        }
+    }
+
+    bool poll_events() {
+        SDL_Event event;
+        while (SDL_PollEvent(&event)) {
+            switch (event.type) {
+            case SDL_QUIT:
+                return false;
+            case SDL_KEYDOWN:
+                held |= button_for(event.key.keysym.sym);
+                break;
+            case SDL_KEYUP:
+                held &= ~button_for(event.key.keysym.sym);
+                break;
+            default:
+                break;
+            }
+        }
+        return true;
+    }
+};
@@ -0,0 +1,250 @@
+#ifndef RGB_RASTERIZER_CPP
+#define RGB_RASTERIZER_CPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "mmu.hpp"
+#include "framebuffer.cpp"
+
+// One OAM entry as stored in memory
+struct Sprite {
+    uint8_t y;
+    uint8_t x;
+    uint8_t tile;
+    uint8_t attributes;
+};
+
+// Everything the rasterizer needs to draw one line, captured when the
+// line is drawn by the hardware
+struct ScanlineRegs {
+    static constexpr int MAX_SPRITES = 10;
+
+    uint8_t line;
+    uint8_t scroll_x;
+    uint8_t scroll_y;
+    uint8_t lcdc;
+    uint8_t bg_palette;
+    uint8_t obj_palette0;
+    uint8_t obj_palette1;
+    uint8_t window_x;
+    uint8_t window_y;
+    uint8_t window_line;
+    uint32_t vram_version;
+    bool cgb;
+
+    // Sprites on this line, highest priority first
+    uint8_t sprite_count;
+    Sprite sprites[MAX_SPRITES];
+};
+
+// Turns VRAM contents and a line's registers into framebuffer indices.
+// Holds no reference to the MMU so it can run on any thread.
+class Rasterizer {
+  private:
+    static constexpr size_t BANK_TILES = MMU::TILE_COUNT / 2;
+
+    // Tile data decoded to one colour number (0-3) per byte. Tiles
+    // 0-255 start at 0x8000 and tiles 256-383 at 0x9000, so signed tile ids
+    // (LCDC bit 4 clear) map 0-127 onto 256-383. The second VRAM bank's
+    // tiles follow at BANK_TILES.
+    uint8_t tiles[MMU::TILE_COUNT][8][8];
+
+  public:
+    // Decode the tiles set in dirty_tiles and clear them
+    void update_tiles(const uint8_t *vram, uint64_t *dirty_tiles) {
+        for (size_t word = 0; word < MMU::TILE_COUNT / 64; word++) {
+            while (dirty_tiles[word]) {
+                size_t tile = (word << 6) | __builtin_ctzll(dirty_tiles[word]);
+                dirty_tiles[word] &= dirty_tiles[word] - 1;
+
+                const uint8_t *data = vram + (tile >= BANK_TILES ? 0x2000 + ((tile - BANK_TILES) << 4) : tile << 4);
+                for (int y = 0; y < 8; y++) {
+                    uint8_t lower = data[y * 2];
+                    uint8_t upper = data[y * 2 + 1];
+                    for (int x = 0; x < 8; x++) {
+                        tiles[tile][y][x] = static_cast<uint8_t>(
+                            ((lower >> (7 - x)) & 1) | (((upper >> (7 - x)) & 1) << 1));
+                    }
+                }
+            }
+        }
+    }
+
+    // Copy the tile rows for count tiles of map row map_row, starting at
+    // map column column, into out. The tile data area is resolved once per
+    // tile rather than per pixel.
+    void fetch_tiles(const uint8_t *map_row, int column, int count, int row, bool signed_ids, uint8_t *out) {
+        for (int i = 0; i < count; i++) {
+            uint8_t id = map_row[(column + i) & 31];
+            size_t tile = (signed_ids && id < 128) ? id + 256 : id;
+            std::memcpy(out + i * 8, tiles[tile][row], 8);
+        }
+    }
+
+    // As fetch_tiles, for CGB maps: each tile's attributes in the second
+    // bank pick its bank and flips, and are copied per pixel into attrs
+    void fetch_tiles_cgb(const uint8_t *map_row, int column, int count, int row, bool signed_ids,
+                         uint8_t *out, uint8_t *attrs) {
+        const uint8_t *attr_row = map_row + 0x2000;
+        for (int i = 0; i < count; i++) {
+            uint8_t id = map_row[(column + i) & 31];
+            uint8_t attr = attr_row[(column + i) & 31];
+            size_t tile = ((signed_ids && id < 128) ? id + 256 : id) + ((attr & 0x08) ? BANK_TILES : 0);
+            const uint8_t *pixels = tiles[tile][(attr & 0x40) ? 7 - row : row];
+            if (attr & 0x20) {
+                std::reverse_copy(pixels, pixels + 8, out + i * 8);
+            } else {
+                std::memcpy(out + i * 8, pixels, 8);
+            }
+            std::memset(attrs + i * 8, attr, 8);
+        }
+    }
+
+    void render_line(const ScanlineRegs &regs, const uint8_t *vram, Framebuffer &framebuffer) {
+        uint8_t *out = framebuffer.line(regs.line);
+
+        // LCD off: blank line
+        if (!(regs.lcdc & 0x80)) {
+            std::memset(out, 0, Framebuffer::WIDTH);
+            return;
+        }
+        if (regs.cgb) {
+            render_line_cgb(regs, vram, out);
+            return;
+        }
+
+        // Background colour numbers for the whole line. The window replaces
+        // the background from window_start on, so each layer is copied as
+        // one run and no pixel looks at layer state.
+        uint8_t colors[Framebuffer::WIDTH];
+        if (regs.lcdc & 0x01) {
+            bool signed_ids = !(regs.lcdc & 0x10);
+            int window_start = Framebuffer::WIDTH;
+            if ((regs.lcdc & 0x20) && regs.line >= regs.window_y && regs.window_x < Framebuffer::WIDTH + 7) {
+                window_start = std::max(0, regs.window_x - 7);
+            }
+
+            uint8_t run[Framebuffer::WIDTH + 16];
+            if (window_start > 0) {
+                auto y = static_cast<uint8_t>(regs.line + regs.scroll_y);
+                const uint8_t *map = vram + ((regs.lcdc & 0x08) ? 0x1c00 : 0x1800) + ((y >> 3) << 5);
+                fetch_tiles(map, regs.scroll_x >> 3, (window_start + 7) / 8 + 1, y & 7, signed_ids, run);
+                std::memcpy(colors, run + (regs.scroll_x & 7), window_start);
+            }
+            if (window_start < Framebuffer::WIDTH) {
+                uint8_t y = regs.window_line;
+                const uint8_t *map = vram + ((regs.lcdc & 0x40) ? 0x1c00 : 0x1800) + ((y >> 3) << 5);
+                // The window's left edge is at WX - 7; a smaller WX clips it
+                int skip = std::max(0, 7 - regs.window_x);
+                fetch_tiles(map, 0, Framebuffer::WIDTH / 8 + 1, y & 7, signed_ids, run);
+                std::memcpy(colors + window_start, run + skip, Framebuffer::WIDTH - window_start);
+            }
+
+            uint8_t shades[4];
+            for (int i = 0; i < 4; i++) {
+                shades[i] = (regs.bg_palette >> (i * 2)) & 3;
+            }
+            for (int i = 0; i < Framebuffer::WIDTH; i++) {
+                out[i] = shades[colors[i]];
+            }
+        } else {
+            // Background and window disabled; sprites still draw over blank
+            std::memset(colors, 0, sizeof(colors));
+            std::memset(out, 0, Framebuffer::WIDTH);
+        }
+
+        if (regs.lcdc & 0x02) {
+            render_sprites(regs, colors, out);
+        }
+    }
+
+    // CGB lines index the colour palettes: 4 * palette + colour for the
+    // background and 32 + 4 * palette + colour for sprites. LCDC bit 0
+    // no longer hides the background, it only drops its priority.
+    void render_line_cgb(const ScanlineRegs &regs, const uint8_t *vram, uint8_t *out) {
+        bool signed_ids = !(regs.lcdc & 0x10);
+        int window_start = Framebuffer::WIDTH;
+        if ((regs.lcdc & 0x20) && regs.line >= regs.window_y && regs.window_x < Framebuffer::WIDTH + 7) {
+            window_start = std::max(0, regs.window_x - 7);
+        }
+
+        uint8_t colors[Framebuffer::WIDTH];
+        uint8_t attrs[Framebuffer::WIDTH];
+        uint8_t run[Framebuffer::WIDTH + 16];
+        uint8_t attr_run[Framebuffer::WIDTH + 16];
+        if (window_start > 0) {
+            auto y = static_cast<uint8_t>(regs.line + regs.scroll_y);
+            const uint8_t *map = vram + ((regs.lcdc & 0x08) ? 0x1c00 : 0x1800) + ((y >> 3) << 5);
+            fetch_tiles_cgb(map, regs.scroll_x >> 3, (window_start + 7) / 8 + 1, y & 7, signed_ids, run, attr_run);
+            std::memcpy(colors, run + (regs.scroll_x & 7), window_start);
+            std::memcpy(attrs, attr_run + (regs.scroll_x & 7), window_start);
+        }
+        if (window_start < Framebuffer::WIDTH) {
+            uint8_t y = regs.window_line;
+            const uint8_t *map = vram + ((regs.lcdc & 0x40) ? 0x1c00 : 0x1800) + ((y >> 3) << 5);
+            int skip = std::max(0, 7 - regs.window_x);
+            fetch_tiles_cgb(map, 0, Framebuffer::WIDTH / 8 + 1, y & 7, signed_ids, run, attr_run);
+            std::memcpy(colors + window_start, run + skip, Framebuffer::WIDTH - window_start);
+            std::memcpy(attrs + window_start, attr_run + skip, Framebuffer::WIDTH - window_start);
+        }
+
+        for (int i = 0; i < Framebuffer::WIDTH; i++) {
+            out[i] = static_cast<uint8_t>((attrs[i] & 7) * 4 + colors[i]);
+        }
+
+        if (regs.lcdc & 0x02) {
+            render_sprites(regs, colors, out, (regs.lcdc & 0x01) ? attrs : nullptr);
+        }
+    }
+
+    // Draws the line's pre-scanned sprites over the background. bg holds
+    // the background colour numbers, which decide sprite-behind-BG pixels.
+    // On CGB, bg_attrs holds the background tile attributes, or is null
+    // when the background has lost priority.
+    void render_sprites(const ScanlineRegs &regs, const uint8_t *bg, uint8_t *out,
+                        const uint8_t *bg_attrs = nullptr) {
+        int height = (regs.lcdc & 0x04) ? 16 : 8;
+
+        // A pixel belongs to the highest priority sprite that is opaque
+        // there, even when that sprite is hidden behind the background
+        bool claimed[Framebuffer::WIDTH] = {};
+
+        for (int s = 0; s < regs.sprite_count; s++) {
+            const Sprite &sprite = regs.sprites[s];
+            int row = regs.line + 16 - sprite.y;
+            if (sprite.attributes & 0x40) {
+                row = height - 1 - row;
+            }
+            size_t tile = height == 16 ? (sprite.tile & 0xfe) + (row >> 3) : sprite.tile;
+            if (regs.cgb && (sprite.attributes & 0x08)) {
+                tile += BANK_TILES;
+            }
+            const uint8_t *pixels = tiles[tile][row & 7];
+
+            uint8_t palette = (sprite.attributes & 0x10) ? regs.obj_palette1 : regs.obj_palette0;
+            bool flip = sprite.attributes & 0x20;
+            bool behind = sprite.attributes & 0x80;
+
+            int left = sprite.x - 8;
+            for (int px = std::max(0, -left); px < 8 && left + px < Framebuffer::WIDTH; px++) {
+                int x = left + px;
+                uint8_t color = pixels[flip ? 7 - px : px];
+                if (color == 0 || claimed[x]) {
+                    continue;
+                }
+                claimed[x] = true;
+                if (regs.cgb) {
+                    bool hidden = bg_attrs && (behind || (bg_attrs[x] & 0x80)) && bg[x] != 0;
+                    if (!hidden) {
+                        out[x] = static_cast<uint8_t>(32 + (sprite.attributes & 7) * 4 + color);
+                    }
+                } else if (!behind || bg[x] == 0) {
+                    out[x] = (palette >> (color * 2)) & 3;
+                }
+            }
+        }
+    }
+};
+
+#endif //RGB_RASTERIZER_CPP
@@ -0,0 +1,218 @@
+#ifndef RGB_RENDER_PIPELINE_CPP
+#define RGB_RENDER_PIPELINE_CPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include "mmu.hpp"
+#include "framebuffer.cpp"
+#include "rasterizer.cpp"
+#include "util/spsc_queue.hpp"
+#include "util/trace.hpp"
+
+// Rasterizes frames on a separate thread. The emulation thread records each
+// line's registers into a queue; VRAM is copied into a snapshot slot only
+// when it changed since the previous line. The render thread replays the
+// lines through its own Rasterizer, so the output is identical to drawing
+// them synchronously, one frame later.
+class RenderPipeline {
+  private:
+    static constexpr size_t SNAPSHOT_SLOTS = 8;
+    // Frames in flight are bounded by latest_frame(), so a few palette
+    // slots are enough
+    static constexpr size_t PALETTE_SLOTS = 4;
+    static constexpr uint8_t NO_PALETTE = 0xff;
+
+    struct VramSnapshot {
+        uint8_t data[0x4000];
+        uint64_t dirty_tiles[MMU::TILE_COUNT / 64];
+    };
+
+    struct Command {
+        enum Kind : uint8_t { LINE, END_FRAME, STOP } kind;
+        uint8_t slot;
+        ScanlineRegs regs;
+        // END_FRAME: compute the frame's hash too
+        bool hash;
+    };
+
+    MMU &mmu;
+    VramSnapshot snapshots[SNAPSHOT_SLOTS];
+    uint32_t palettes[PALETTE_SLOTS][Framebuffer::CGB_COLORS];
+    SpscQueue<Command, 512> commands;
+    SpscQueue<uint8_t, SNAPSHOT_SLOTS> free_slots;
+
+    // Emulation thread state
+    uint32_t published_version = 0;
+    uint8_t published_slot = 0;
+    bool published = false;
+    uint64_t frames_recorded = 0;
+
+    // Render thread state
+    Rasterizer rasterizer;
+    Framebuffer frames[2];
+    // The CGB palette as of the frame being drawn, and which change of it
+    // each buffer has applied. A buffer is only recolored when it is drawn
+    // into, as the other one may be read at the time.
+    uint32_t colors[Framebuffer::CGB_COLORS];
+    uint64_t colors_version = 0;
+    uint64_t frame_colors_version[2] = {};
+
+    std::atomic<uint64_t> frames_completed{0};
+    std::mutex lock;
+    std::condition_variable changed;
+    uint64_t wake_count = 0;
+    std::thread worker;
+
+    // Blocking is only needed at frame boundaries and when the queue or
+    // snapshot pool is exhausted; lines are otherwise pushed lock-free
+    void wake() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            wake_count++;
+        }
+        changed.notify_all();
+    }
+
+    void push(const Command &command) {
+        while (!commands.push(command)) {
+            wake();
+            std::this_thread::yield();
+        }
+    }
+
+    uint8_t snapshot_vram() {
+        uint8_t slot;
+        while (!free_slots.pop(slot)) {
+            wake();
+            std::this_thread::yield();
+        }
+        VramSnapshot &snapshot = snapshots[slot];
+        std::memcpy(snapshot.data, mmu.vram(), mmu.vram_size());
+        std::copy(std::begin(mmu.dirty_tiles), std::end(mmu.dirty_tiles), snapshot.dirty_tiles);
+        std::fill(std::begin(mmu.dirty_tiles), std::end(mmu.dirty_tiles), 0);
+        return slot;
+    }
+
+    void run() {
+        RGB_TRACE_THREAD_NAME("render");
+        int current = -1;
+        uint64_t frame = 0;
+        for (;;) {
+            Command command;
+            uint64_t seen;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                seen = wake_count;
+            }
+            if (!commands.pop(command)) {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&] { return wake_count != seen || !commands.empty(); });
+                continue;
+            }
+
+            switch (command.kind) {
+            case Command::LINE:
+                if (command.slot != current) {
+                    if (current >= 0) {
+                        free_slots.push(static_cast<uint8_t>(current));
+                    }
+                    current = command.slot;
+                    rasterizer.update_tiles(snapshots[current].data, snapshots[current].dirty_tiles);
+                }
+                {
+                    RGB_TRACE_SCOPE("scanline");
+                    rasterizer.render_line(command.regs, snapshots[current].data, frames[frame & 1]);
+                }
+                break;
+            case Command::END_FRAME:
+                if (command.slot != NO_PALETTE) {
+                    std::copy(palettes[command.slot], palettes[command.slot] + Framebuffer::CGB_COLORS, colors);
+                    colors_version++;
+                }
+                if (frame_colors_version[frame & 1] != colors_version) {
+                    for (int i = 0; i < Framebuffer::CGB_COLORS; i++) {
+                        frames[frame & 1].set_color(static_cast<uint8_t>(i), colors[i]);
+                    }
+                    frame_colors_version[frame & 1] = colors_version;
+                }
+                {
+                    RGB_TRACE_SCOPE("convert frame");
+                    frames[frame & 1].convert();
+                }
+                if (command.hash) {
+                    frames[frame & 1].update_hash();
+                }
+                frame++;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    frames_completed.store(frame, std::memory_order_release);
+                }
+                changed.notify_all();
+                break;
+            case Command::STOP:
+                return;
+            }
+        }
+    }
+
+  public:
+    RenderPipeline(MMU &_mmu) : mmu(_mmu) {
+        for (uint8_t slot = 0; slot < SNAPSHOT_SLOTS; slot++) {
+            free_slots.push(slot);
+        }
+        // The render thread starts with an empty tile cache
+        std::fill(std::begin(mmu.dirty_tiles), std::end(mmu.dirty_tiles), ~0ull);
+        worker = std::thread(&RenderPipeline::run, this);
+    }
+
+    ~RenderPipeline() {
+        push(Command { Command::STOP, 0, ScanlineRegs(), false });
+        wake();
+        worker.join();
+    }
+
+    RenderPipeline(const RenderPipeline &) = delete;
+    RenderPipeline &operator=(const RenderPipeline &) = delete;
+
+    void push_line(ScanlineRegs regs) {
+        if (!published || regs.vram_version != published_version) {
+            published_slot = snapshot_vram();
+            published_version = regs.vram_version;
+            published = true;
+        }
+        push(Command { Command::LINE, published_slot, regs, false });
+    }
+
+    // colors, if not null, replaces the CGB palette from this frame on
+    void end_frame(const uint32_t *colors, bool hash) {
+        uint8_t slot = NO_PALETTE;
+        if (colors) {
+            slot = static_cast<uint8_t>(frames_recorded % PALETTE_SLOTS);
+            std::copy(colors, colors + Framebuffer::CGB_COLORS, palettes[slot]);
+        }
+        push(Command { Command::END_FRAME, slot, ScanlineRegs(), hash });
+        frames_recorded++;
+        wake();
+    }
+
+    // The newest frame that is safe to read: the one before the frame just
+    // recorded. Its buffer is not written again until another frame has
+    // been recorded.
+    const Framebuffer &latest_frame() {
+        if (frames_recorded < 2) {
+            return frames[1];
+        }
+        uint64_t wanted = frames_recorded - 1;
+        if (frames_completed.load(std::memory_order_acquire) < wanted) {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&] { return frames_completed.load(std::memory_order_acquire) >= wanted; });
+        }
+        return frames[(wanted - 1) & 1];
+    }
+};
+
+#endif //RGB_RENDER_PIPELINE_CPP
@@ -0,0 +1,103 @@
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "capture.cpp"
+#include "movie.cpp"
+
+// Headless movie playback for regression runs: no window, no sound device
+// and no drawing, as fast as the machine goes. Exits non-zero if a
+// checkpoint doesn't match or the movie is for another ROM. --capture
+// draws the frames after all and records them; see capture.cpp. --perf
+// writes hardware counters for each frame as CSV; see perf_counters.hpp.
+//
+//   rgb_replay movie [rom] [--capture file] [--perf file]
+
+int main(int argc, char **argv)
+{
+    std::string movie_path;
+    std::string rom_path = RGB::DEFAULT_ROM;
+    std::string capture_path;
+    std::string perf_path;
+    int positional = 0;
+    bool usage = false;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--perf") == 0 && i + 1 < argc) {
+            perf_path = argv[++i];
+        } else if (argv[i][0] == '-') {
+            usage = true;
+        } else {
+            (positional++ == 0 ? movie_path : rom_path) = argv[i];
+        }
+    }
+    if (usage || movie_path.empty()) {
+        std::cerr << "usage: rgb_replay movie [rom] [--capture file] [--perf file]\n";
+        return 2;
+    }
+
+    Movie movie;
+    std::unique_ptr<RGB> rgb;
+    std::unique_ptr<FrameCapture> capture;
+    try {
+        movie = Movie::load(movie_path);
+        std::vector<uint8_t> rom = MMU::read_rom(rom_path);
+        if (Movie::hash_rom(rom) != movie.rom_hash) {
+            std::cerr << movie_path << " was recorded with a different ROM than " << rom_path << "\n";
+            return 1;
+        }
+        rgb.reset(new RGB(std::move(rom)));
+        if (!capture_path.empty()) {
+            capture.reset(new FrameCapture(capture_path, rgb->cgb()));
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    std::ofstream perf_csv;
+    std::unique_ptr<PerfProfiler> profiler;
+    if (!perf_path.empty()) {
+        perf_csv.open(perf_path);
+        profiler.reset(new PerfProfiler(perf_csv));
+        if (!perf_csv || !profiler->events().any()) {
+            std::cerr << "Can't profile to " << perf_path << "\n";
+            return 1;
+        }
+        if (!profiler->events().missing().empty()) {
+            std::cerr << "Not counted here: " << profiler->events().missing() << "\n";
+        }
+        rgb->set_profiler(profiler.get());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    MoviePlayer::Result result = capture
+        ? MoviePlayer::play(*rgb, movie, [&](const Framebuffer &frame) { capture->add(frame); })
+        : MoviePlayer::play(*rgb, movie);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (profiler) {
+        rgb->set_profiler(nullptr);
+        profiler->summary(std::cerr);
+    }
+    if (capture) {
+        capture->close();
+        std::cout << capture_path << ": " << capture->frames_added() << " frames captured, " << capture->bytes()
+                  << " bytes, " << capture->stalled_frames() << " waited for the writer\n";
+    }
+
+    if (result.diverged) {
+        std::cout << movie_path << ": diverged at frame " << result.diverged_frame << ", state "
+                  << std::hex << result.actual << " instead of " << result.expected << std::dec
+                  << " (" << result.checkpoints_passed << " checkpoints passed)\n";
+        return 1;
+    }
+    std::cout << movie_path << ": " << result.frames << " of " << movie.inputs.size() << " frames, "
+              << result.checkpoints_passed << " of " << movie.checkpoints.size()
+              << " checkpoints passed, " << result.frames / seconds << " fps\n";
+    return result.checkpoints_passed == movie.checkpoints.size() ? 0 : 1;
+}
@@ -1,26 +1,168 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
 #include <iostream>
-#include "z80.cpp"
-#include "gpu.cpp"
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "live_stats.cpp"
+#include "movie.cpp"
+#include "presenter.cpp"
 
-class RGB {
-    MMU mmu = MMU();
-    Z80 z80 = Z80(mmu);
-    GPU gpu = GPU(mmu);
+int main(int argc, char **argv)
+{
+    std::string rom = RGB::DEFAULT_ROM;
+    bool capped = true;
+    bool pipelined = false;
+    bool muted = false;
+    bool software = false;
+    bool run_ahead = false;
+    bool publish_stats = false;
+    int ahead_frames = 0;
+    int scale = 4;
+    std::string record;
+    uint32_t record_after = 0;
+    std::string trace_path;
+    std::string perf_path;
+    uint32_t checkpoint_interval = 60;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--uncapped") == 0) {
+            capped = false;
+        } else if (std::strcmp(argv[i], "--pipeline") == 0) {
+            pipelined = true;
+        } else if (std::strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc) {
+            ahead_frames = std::max(0, std::atoi(argv[++i]));
+            run_ahead = true;
+        } else if (std::strcmp(argv[i], "--mute") == 0) {
+            muted = true;
+        } else if (std::strcmp(argv[i], "--software") == 0) {
+            software = true;
+        } else if (std::strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--perf") == 0 && i + 1 < argc) {
+            perf_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--stats") == 0) {
+            publish_stats = true;
+        } else if (std::strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record = argv[++i];
+        } else if (std::strcmp(argv[i], "--record-after") == 0 && i + 1 < argc) {
+            record_after = static_cast<uint32_t>(std::max(0, std::atoi(argv[++i])));
+        } else if (std::strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+            checkpoint_interval = static_cast<uint32_t>(std::max(1, std::atoi(argv[++i])));
+        } else if (argv[i][0] != '-') {
+            rom = argv[i];
+        }
+    }
+
+    // The presenter's audio callback reads from rgb, so rgb must outlive it
+    std::unique_ptr<RGB> rgb;
+    Movie movie;
+    try {
+        std::vector<uint8_t> data = MMU::read_rom(rom);
+        uint64_t rom_hash = Movie::hash_rom(data);
+        rgb.reset(new RGB(std::move(data)));
+        movie.begin(*rgb, rom_hash, false);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    RGB_TRACE_THREAD_NAME("emulation");
+    Presenter presenter;
+    presenter.set_capped(capped);
+    presenter.set_software(software);
+    presenter.set_scale(scale);
+    rgb->set_run_ahead(ahead_frames);
+    if (!muted) {
+        presenter.set_audio(&rgb->audio_output());
+    }
+    if (!presenter.init()) {
+        std::cerr << "Failed to initialize video: " << SDL_GetError() << "\n";
+        return 1;
+    }
+
+    rgb->set_sample_rate(presenter.sample_rate());
+    if (pipelined && run_ahead) {
+        std::cerr << "--pipeline has no effect with --run-ahead\n";
+        pipelined = false;
+    }
+    rgb->set_pipelined(pipelined);
+    if (record_after > 0 && record.empty()) {
+        std::cerr << "--record-after has no effect without --record\n";
+    }
 
-  public:
-    void run_loop() {
-        while (!z80.halt && !z80.stop) {
-            z80.exec();
-            gpu.step(z80.reg.t);
+    // Hardware counters per frame, as CSV
+    std::ofstream perf_csv;
+    std::unique_ptr<PerfProfiler> profiler;
+    if (!perf_path.empty()) {
+        perf_csv.open(perf_path);
+        profiler.reset(new PerfProfiler(perf_csv));
+        if (!perf_csv || !profiler->events().any()) {
+            std::cerr << "Can't profile to " << perf_path << "\n";
+            return 1;
+        }
+        if (!profiler->events().missing().empty()) {
+            std::cerr << "Not counted here: " << profiler->events().missing() << "\n";
         }
+        rgb->set_profiler(profiler.get());
     }
-};
 
-int main(int argc, char **argv)
-{
-    RGB rgb = RGB();
-    rgb.run_loop();
+    // Counters for rgb_monitor, in /rgb-<pid>
+    std::unique_ptr<LiveStats> stats;
+    if (publish_stats) {
+        try {
+            stats.reset(new LiveStats(live_stats_own_name()));
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+    }
 
-    // rgb.mmu.load_rom();
+    // The presenter, with stats published and the movie recorded on top
+    auto run = [&](auto &frontend) {
+        if (record.empty()) {
+            rgb->run_loop(frontend);
+            return true;
+        }
+        MovieRecorder<std::remove_reference_t<decltype(frontend)>> recorder(frontend, *rgb, movie,
+                                                                           checkpoint_interval, record_after);
+        rgb->run_loop(recorder);
+        if (!recorder.started()) {
+            std::cerr << "Stopped before frame " << record_after << ", so nothing was recorded\n";
+            return true;
+        }
+        recorder.finish();
+        try {
+            movie.save(record);
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << "\n";
+            return false;
+        }
+        return true;
+    };
+    bool saved;
+    if (stats) {
+        StatsPublisher<Presenter> publisher(presenter, *rgb, *stats);
+        saved = run(publisher);
+    } else {
+        saved = run(presenter);
+    }
+    if (!saved) {
+        return 1;
+    }
+    rgb->report_run_ahead(std::cerr);
+    if (profiler) {
+        rgb->set_profiler(nullptr);
+        profiler->summary(std::cerr);
+    }
+    if (!trace_path.empty() && !trace_write(trace_path)) {
+        std::cerr << "Can't write trace " << trace_path << " (tracing needs a build with RGB_TRACE)\n";
+        return 1;
+    }
     return 0;
 }
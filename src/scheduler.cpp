@@ -0,0 +1,134 @@
+#ifndef RGB_SCHEDULER_CPP
+#define RGB_SCHEDULER_CPP
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+enum class Event : uint8_t {
+    TIMER_OVERFLOW,
+    INTERRUPT,
+    OAM_DMA_END,
+    COUNT
+};
+
+// Master cycle counter plus a handful of one-shot events keyed by type.
+// The run loop advances the counter after every instruction and only
+// dispatches when the earliest event is due, so components that schedule
+// their work here cost one comparison per instruction in total.
+class Scheduler {
+  public:
+    using Handler = void (*)(void *context, uint64_t when);
+    static constexpr uint64_t NEVER = std::numeric_limits<uint64_t>::max();
+
+  private:
+    static constexpr int EVENT_COUNT = static_cast<int>(Event::COUNT);
+
+    uint64_t now = 0;
+    uint64_t next_event = NEVER;
+    uint64_t when[EVENT_COUNT];
+    Handler handlers[EVENT_COUNT] = {};
+    void *contexts[EVENT_COUNT] = {};
+
+    void update_next() {
+        next_event = NEVER;
+        for (uint64_t at : when) {
+            if (at < next_event) {
+                next_event = at;
+            }
+        }
+    }
+
+  public:
+    Scheduler() {
+        for (uint64_t &at : when) {
+            at = NEVER;
+        }
+    }
+
+    // T-cycles since power on
+    uint64_t cycles() const {
+        return now;
+    }
+
+    void set_handler(Event event, Handler handler, void *context) {
+        handlers[static_cast<int>(event)] = handler;
+        contexts[static_cast<int>(event)] = context;
+    }
+
+    // (Re)schedule event for cycle at, replacing any pending occurrence
+    void schedule(Event event, uint64_t at) {
+        when[static_cast<int>(event)] = at;
+        if (at < next_event) {
+            next_event = at;
+        } else {
+            update_next();
+        }
+    }
+
+    void cancel(Event event) {
+        when[static_cast<int>(event)] = NEVER;
+        update_next();
+    }
+
+    uint64_t scheduled(Event event) const {
+        return when[static_cast<int>(event)];
+    }
+
+    // Cycles until the earliest pending event
+    uint64_t until_next() const {
+        return next_event == NEVER ? NEVER : next_event - now;
+    }
+
+    void advance(uint32_t cycles) {
+        now += cycles;
+        if (now >= next_event) {
+            dispatch();
+        }
+    }
+
+    // Account for cycles spent outside instructions, e.g. interrupt
+    // dispatch. Safe to call from a handler; due events run in the same
+    // dispatch.
+    void stall(uint32_t cycles) {
+        now += cycles;
+    }
+
+    // Pending events for save states; handlers are fixed at construction
+    struct State {
+        uint64_t now;
+        uint64_t next_event;
+        uint64_t when[EVENT_COUNT];
+    };
+
+    void save(State &state) const {
+        state.now = now;
+        state.next_event = next_event;
+        std::copy(when, when + EVENT_COUNT, state.when);
+    }
+
+    void load(const State &state) {
+        now = state.now;
+        next_event = state.next_event;
+        std::copy(state.when, state.when + EVENT_COUNT, when);
+    }
+
+    // Run every event that is due, earliest first. Handlers get the cycle
+    // the event was due at, which may be slightly before now.
+    void dispatch() {
+        while (next_event <= now) {
+            int event = 0;
+            for (int i = 1; i < EVENT_COUNT; i++) {
+                if (when[i] < when[event]) {
+                    event = i;
+                }
+            }
+            uint64_t at = when[event];
+            when[event] = NEVER;
+            update_next();
+            handlers[event](contexts[event], at);
+        }
+    }
+};
+
+#endif //RGB_SCHEDULER_CPP
@@ -0,0 +1,140 @@
+#ifndef RGB_TIMER_CPP
+#define RGB_TIMER_CPP
+
+#include <cstdint>
+#include "mmu.hpp"
+#include "interrupts.cpp"
+#include "scheduler.cpp"
+#include "util/hash.hpp"
+
+// DIV and TIMA computed on demand from the scheduler's cycle counter.
+// Nothing runs between instructions: reads work out the current value,
+// and the next TIMA overflow is a single scheduled event that writes to
+// TAC, TIMA or DIV move.
+class Timer {
+  private:
+    MMU &mmu;
+    Scheduler &scheduler;
+    Interrupts &interrupts;
+    uint8_t *io;
+
+    // DIV is the top byte of a 16-bit counter that runs at the CPU clock
+    // and restarts when DIV is written
+    uint64_t div_origin = 0;
+
+    // TIMA was tima_base at cycle tima_origin; since then it has counted
+    // falling edges of counter bit (shift - 1)
+    uint64_t tima_origin = 0;
+    uint8_t tima_base = 0;
+
+    bool enabled() const {
+        return io[IO_TAC] & 0x04;
+    }
+
+    // log2 of the TIMA period in T-cycles, selected by TAC
+    int shift() const {
+        static constexpr int shifts[] = { 10, 4, 6, 8 };
+        return shifts[io[IO_TAC] & 3];
+    }
+
+    uint64_t ticks(uint64_t at) const {
+        return (at - div_origin) >> shift();
+    }
+
+    uint8_t read_div() const {
+        return static_cast<uint8_t>((scheduler.cycles() - div_origin) >> 8);
+    }
+
+    uint8_t read_tima() const {
+        if (!enabled()) {
+            return tima_base;
+        }
+        return static_cast<uint8_t>(tima_base + ticks(scheduler.cycles()) - ticks(tima_origin));
+    }
+
+    // Fold the increments so far into tima_base before anything that
+    // changes how TIMA counts
+    void settle() {
+        tima_base = read_tima();
+        tima_origin = scheduler.cycles();
+    }
+
+    void reschedule() {
+        if (!enabled()) {
+            scheduler.cancel(Event::TIMER_OVERFLOW);
+            return;
+        }
+        uint64_t edge = ticks(tima_origin) + (0x100 - tima_base);
+        scheduler.schedule(Event::TIMER_OVERFLOW, div_origin + (edge << shift()));
+    }
+
+    // TIMA wrapped: reload from TMA, raise the timer interrupt and
+    // schedule the next overflow
+    void overflow(uint64_t when) {
+        tima_base = io[IO_TMA];
+        tima_origin = when;
+        interrupts.request(INT_TIMER);
+        reschedule();
+    }
+
+  public:
+    Timer(MMU &_mmu, Scheduler &_scheduler, Interrupts &_interrupts)
+        : mmu(_mmu), scheduler(_scheduler), interrupts(_interrupts), io(_mmu.io_registers()) {
+        mmu.map_io(IO_DIV, [](void *timer, uint8_t) {
+            return static_cast<Timer *>(timer)->read_div();
+        }, [](void *context, uint8_t, uint8_t) {
+            auto *timer = static_cast<Timer *>(context);
+            timer->settle();
+            timer->div_origin = timer->scheduler.cycles();
+            timer->tima_origin = timer->div_origin;
+            timer->reschedule();
+        }, this);
+        mmu.map_io(IO_TIMA, [](void *timer, uint8_t) {
+            return static_cast<Timer *>(timer)->read_tima();
+        }, [](void *context, uint8_t, uint8_t value) {
+            auto *timer = static_cast<Timer *>(context);
+            timer->tima_base = value;
+            timer->tima_origin = timer->scheduler.cycles();
+            timer->reschedule();
+        }, this);
+        mmu.map_io(IO_TAC, nullptr, [](void *context, uint8_t, uint8_t value) {
+            auto *timer = static_cast<Timer *>(context);
+            timer->settle();
+            timer->io[IO_TAC] = 0xf8 | (value & 0x07);
+            timer->reschedule();
+        }, this);
+        // TMA is plain storage: it is only read when TIMA overflows
+
+        scheduler.set_handler(Event::TIMER_OVERFLOW, [](void *timer, uint64_t when) {
+            static_cast<Timer *>(timer)->overflow(when);
+        }, this);
+        mmu.wb(0xff00 | IO_TAC, 0);
+    }
+
+    struct State {
+        uint64_t div_origin;
+        uint64_t tima_origin;
+        uint8_t tima_base;
+    };
+
+    void save(State &state) const {
+        state.div_origin = div_origin;
+        state.tima_origin = tima_origin;
+        state.tima_base = tima_base;
+    }
+
+    void load(const State &state) {
+        div_origin = state.div_origin;
+        tima_origin = state.tima_origin;
+        tima_base = state.tima_base;
+    }
+
+    // State relative to the current cycle, so equal machine states hash
+    // the same whenever they occur
+    uint64_t hash() const {
+        uint64_t counter = (scheduler.cycles() - div_origin) & 0xffff;
+        return hash_mix(counter | (uint64_t) read_tima() << 16 | (uint64_t) io[IO_TAC] << 24);
+    }
+};
+
+#endif //RGB_TIMER_CPP
@@ -0,0 +1,69 @@
+#ifndef RGB_UTIL_BENCH_STATS_HPP
+#define RGB_UTIL_BENCH_STATS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <ostream>
+#include <vector>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+// Summaries and JSON output shared by the benchmark programs.
+
+struct BenchStats {
+    double mean, stddev, median, min, max;
+};
+
+inline BenchStats bench_summarize(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    BenchStats stats = { 0, 0, 0, values.front(), values.back() };
+    stats.median = n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+    for (double value : values) {
+        stats.mean += value;
+    }
+    stats.mean /= n;
+    for (double value : values) {
+        stats.stddev += (value - stats.mean) * (value - stats.mean);
+    }
+    if (n > 1) {
+        stats.stddev = std::sqrt(stats.stddev / (n - 1));
+    }
+    return stats;
+}
+
+// "key": { "mean": ..., ... } with no trailing separator
+inline void bench_print_stats(std::ostream &out, const char *indent, const char *key,
+                              const std::vector<double> &values)
+{
+    BenchStats stats = bench_summarize(values);
+    out << indent << "\"" << key << "\": { \"mean\": " << stats.mean << ", \"stddev\": " << stats.stddev
+        << ", \"median\": " << stats.median << ", \"min\": " << stats.min << ", \"max\": " << stats.max
+        << " }";
+}
+
+// Keep the calling thread on one CPU, so timings don't include
+// migrations. Returns false where unsupported or refused.
+inline bool bench_pin_cpu(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void) cpu;
+    return false;
+#endif
+}
+
+// Stops the optimizer from discarding a benchmarked result
+template <class T>
+inline void bench_keep(const T &value)
+{
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+#endif //RGB_UTIL_BENCH_STATS_HPP
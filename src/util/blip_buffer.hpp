@@ -0,0 +1,110 @@
+#ifndef RGB_UTIL_BLIP_BUFFER_HPP
+#define RGB_UTIL_BLIP_BUFFER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Band-limited step synthesis. The source records only the changes in its
+// output level, each at a clock time; every change is added to the buffer
+// as a windowed-sinc impulse, and reading integrates the impulses back
+// into samples. The cost is per level change rather than per clock, and
+// square waves come out without aliasing.
+class BlipBuffer {
+  public:
+    static constexpr int PHASE_BITS = 5;
+    static constexpr int PHASES = 1 << PHASE_BITS;
+    // Impulse width in samples; output lags input by half of it
+    static constexpr int TAPS = 16;
+
+  private:
+    static constexpr int FRAC_BITS = 32;
+
+    // Samples per clock, and the position of clock 0 of the current frame,
+    // both in 32.32 fixed point
+    uint64_t factor = 0;
+    uint64_t offset = 0;
+
+    std::vector<float> buffer;
+    float kernel[PHASES][TAPS];
+    float integrator = 0;
+    float dc = 0;
+
+    void build_kernel() {
+        const double pi = 3.14159265358979323846;
+        for (int phase = 0; phase < PHASES; phase++) {
+            double sum = 0;
+            double impulse[TAPS];
+            for (int tap = 0; tap < TAPS; tap++) {
+                double x = tap - TAPS / 2 + 1 - static_cast<double>(phase) / PHASES;
+                double sinc = x == 0 ? 1 : std::sin(pi * x) / (pi * x);
+                // Blackman window over the kernel's width
+                double w = (x + TAPS / 2) / TAPS;
+                double window = 0.42 - 0.5 * std::cos(2 * pi * w) + 0.08 * std::cos(4 * pi * w);
+                impulse[tap] = sinc * window;
+                sum += impulse[tap];
+            }
+            // Each impulse integrates to exactly one step
+            for (int tap = 0; tap < TAPS; tap++) {
+                kernel[phase][tap] = static_cast<float>(impulse[tap] / sum);
+            }
+        }
+    }
+
+  public:
+    // Holds up to max_samples of output that has not been read yet
+    explicit BlipBuffer(size_t max_samples) : buffer(max_samples + TAPS) {
+        build_kernel();
+    }
+
+    void set_rates(double clock_rate, double sample_rate) {
+        factor = static_cast<uint64_t>(sample_rate / clock_rate * (1ull << FRAC_BITS));
+    }
+
+    // Change the output level by delta at clock, relative to the frame start
+    void add_delta(uint32_t clock, float delta) {
+        uint64_t pos = offset + clock * factor;
+        size_t index = pos >> FRAC_BITS;
+        if (index >= buffer.size() - TAPS) {
+            return;
+        }
+        const float *impulse = kernel[(pos >> (FRAC_BITS - PHASE_BITS)) & (PHASES - 1)];
+        float *out = buffer.data() + index;
+        for (int tap = 0; tap < TAPS; tap++) {
+            out[tap] += delta * impulse[tap];
+        }
+    }
+
+    // End the frame after clocks; its samples can now be read, and later
+    // clock times are relative to the end of it
+    void end_frame(uint32_t clocks) {
+        offset += clocks * factor;
+        size_t limit = static_cast<uint64_t>(buffer.size() - TAPS) << FRAC_BITS;
+        offset = std::min<uint64_t>(offset, limit);
+    }
+
+    size_t samples_available() const {
+        return offset >> FRAC_BITS;
+    }
+
+    // Read up to count samples into out, every stride elements
+    size_t read_samples(int16_t *out, size_t count, size_t stride) {
+        count = std::min(count, samples_available());
+        for (size_t i = 0; i < count; i++) {
+            integrator += buffer[i];
+            // Gentle high-pass to remove the DC offset of unsigned channels
+            dc += (integrator - dc) * (1.0f / 1024);
+            float sample = std::max(-32768.0f, std::min(32767.0f, integrator - dc));
+            out[i * stride] = static_cast<int16_t>(sample);
+        }
+        std::memmove(buffer.data(), buffer.data() + count, (buffer.size() - count) * sizeof(float));
+        std::fill(buffer.end() - count, buffer.end(), 0.0f);
+        offset -= static_cast<uint64_t>(count) << FRAC_BITS;
+        return count;
+    }
+};
+
+#endif //RGB_UTIL_BLIP_BUFFER_HPP
@@ -0,0 +1,44 @@
+#ifndef RGB_UTIL_HASH_HPP
+#define RGB_UTIL_HASH_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// Small non-cryptographic 64-bit hashing helpers used for state digests.
+
+constexpr uint64_t HASH_PRIME_1 = 0x9e3779b185ebca87ull;
+constexpr uint64_t HASH_PRIME_2 = 0xc2b2ae3d27d4eb4full;
+
+inline uint64_t hash_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// splitmix64 finalizer: spreads every input bit over the whole word
+inline uint64_t hash_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+inline uint64_t hash_bytes(const uint8_t *data, size_t len, uint64_t seed = 0)
+{
+    uint64_t h = seed ^ (len * HASH_PRIME_1);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        h = hash_rotl(h ^ (word * HASH_PRIME_2), 31) * HASH_PRIME_1;
+    }
+    for (; i < len; i++) {
+        h = hash_rotl(h ^ (data[i] * HASH_PRIME_2), 11) * HASH_PRIME_1;
+    }
+    return hash_mix(h);
+}
+
+#endif //RGB_UTIL_HASH_HPP
@@ -0,0 +1,212 @@
+#ifndef RGB_UTIL_LIVE_STATS_HPP
+#define RGB_UTIL_LIVE_STATS_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Counters a running emulator publishes in a POSIX shared memory segment
+// for rgb_monitor to read. Publishing is a handful of plain stores into
+// the mapping: no syscalls, no locks, and the emulation thread never
+// waits for a reader.
+//
+// The emulation thread is the only writer and brackets each update with
+// the sequence number (a seqlock): odd while writing, so a reader retries
+// until it sees the same even number before and after its copy.
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared counters must be lock-free to work across processes");
+
+// Laid out in the segment; bump VERSION on any change
+struct LiveStatsBlock {
+    static constexpr uint64_t MAGIC = 0x5354415453424752;   // "RGBSTATS"
+    static constexpr uint32_t VERSION = 1;
+
+    // Stored last, with release, once the rest is set up
+    std::atomic<uint64_t> magic;
+    uint32_t version;
+    uint32_t pid;
+
+    std::atomic<uint64_t> sequence;
+    // Steady clock at the update, comparable across processes on Linux
+    std::atomic<uint64_t> time_ns;
+    std::atomic<uint64_t> frames;
+    // Host time spent emulating, not counting presentation and pacing
+    std::atomic<uint64_t> busy_ns;
+    std::atomic<uint64_t> instructions;
+    std::atomic<uint64_t> cycles;
+    std::atomic<uint64_t> idle_cycles;
+    std::atomic<uint64_t> audio_underruns;
+};
+
+// One consistent reading of the counters
+struct LiveStatsSample {
+    uint64_t time_ns, frames, busy_ns, instructions, cycles, idle_cycles, audio_underruns;
+};
+
+// Segments are named "/rgb-<pid>"; a name with the slash is used as is
+inline std::string live_stats_name(const std::string &name_or_pid)
+{
+    if (!name_or_pid.empty() && name_or_pid[0] == '/') {
+        return name_or_pid;
+    }
+    return "/rgb-" + name_or_pid;
+}
+
+inline std::string live_stats_own_name()
+{
+#if defined(__unix__) || defined(__APPLE__)
+    return live_stats_name(std::to_string(getpid()));
+#else
+    return "/rgb";
+#endif
+}
+
+// The writing side: creates the segment and removes it when destroyed.
+// Throws std::runtime_error if it can't.
+class LiveStats {
+    std::string name;
+    LiveStatsBlock *block = nullptr;
+
+  public:
+    explicit LiveStats(const std::string &_name) : name(_name) {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof(LiveStatsBlock)) != 0) {
+            std::string error = std::strerror(errno);
+            if (fd >= 0) {
+                close(fd);
+                shm_unlink(name.c_str());
+            }
+            throw std::runtime_error("Can't create stats segment " + name + ": " + error);
+        }
+        void *mapping = mmap(nullptr, sizeof(LiveStatsBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            shm_unlink(name.c_str());
+            throw std::runtime_error("Can't map stats segment " + name + ": " + std::strerror(errno));
+        }
+        // The new segment is zero-filled, which the atomics start from
+        block = static_cast<LiveStatsBlock *>(mapping);
+        block->version = LiveStatsBlock::VERSION;
+        block->pid = static_cast<uint32_t>(getpid());
+        block->magic.store(LiveStatsBlock::MAGIC, std::memory_order_release);
+#else
+        throw std::runtime_error("Stats segments need POSIX shared memory");
+#endif
+    }
+
+    ~LiveStats() {
+#if defined(__unix__) || defined(__APPLE__)
+        munmap(block, sizeof(LiveStatsBlock));
+        shm_unlink(name.c_str());
+#endif
+    }
+
+    LiveStats(const LiveStats &) = delete;
+    LiveStats &operator=(const LiveStats &) = delete;
+
+    // From one thread only
+    void publish(const LiveStatsSample &sample) {
+        uint64_t sequence = block->sequence.load(std::memory_order_relaxed);
+        block->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        block->time_ns.store(sample.time_ns, std::memory_order_relaxed);
+        block->frames.store(sample.frames, std::memory_order_relaxed);
+        block->busy_ns.store(sample.busy_ns, std::memory_order_relaxed);
+        block->instructions.store(sample.instructions, std::memory_order_relaxed);
+        block->cycles.store(sample.cycles, std::memory_order_relaxed);
+        block->idle_cycles.store(sample.idle_cycles, std::memory_order_relaxed);
+        block->audio_underruns.store(sample.audio_underruns, std::memory_order_relaxed);
+        block->sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    const std::string &segment() const {
+        return name;
+    }
+};
+
+// The reading side, for rgb_monitor. Throws std::runtime_error if the
+// segment doesn't exist or isn't one of ours.
+class LiveStatsReader {
+    // A publish is a few stores, so a writer seen mid-update this many
+    // times in a row has died or been stopped there
+    static constexpr int READ_ATTEMPTS = 10000;
+
+    const LiveStatsBlock *block = nullptr;
+
+  public:
+    explicit LiveStatsReader(const std::string &name) {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            throw std::runtime_error("Can't open stats segment " + name + ": " + std::strerror(errno));
+        }
+        // A segment caught between shm_open and ftruncate in the writer is
+        // still empty, and touching the mapping past its end is a SIGBUS
+        struct stat status;
+        if (fstat(fd, &status) != 0 || status.st_size < static_cast<off_t>(sizeof(LiveStatsBlock))) {
+            close(fd);
+            throw std::runtime_error("Stats segment " + name + " isn't set up yet");
+        }
+        void *mapping = mmap(nullptr, sizeof(LiveStatsBlock), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("Can't map stats segment " + name + ": " + std::strerror(errno));
+        }
+        block = static_cast<const LiveStatsBlock *>(mapping);
+        if (block->magic.load(std::memory_order_acquire) != LiveStatsBlock::MAGIC
+            || block->version != LiveStatsBlock::VERSION) {
+            munmap(const_cast<LiveStatsBlock *>(block), sizeof(LiveStatsBlock));
+            throw std::runtime_error(name + " isn't a version " + std::to_string(LiveStatsBlock::VERSION)
+                                     + " stats segment");
+        }
+#else
+        (void) name;
+        throw std::runtime_error("Stats segments need POSIX shared memory");
+#endif
+    }
+
+    ~LiveStatsReader() {
+#if defined(__unix__) || defined(__APPLE__)
+        munmap(const_cast<LiveStatsBlock *>(block), sizeof(LiveStatsBlock));
+#endif
+    }
+
+    LiveStatsReader(const LiveStatsReader &) = delete;
+    LiveStatsReader &operator=(const LiveStatsReader &) = delete;
+
+    uint32_t pid() const {
+        return block->pid;
+    }
+
+    // False if no consistent reading could be had: the writer stopped in
+    // the middle of an update and the segment is stale
+    bool read(LiveStatsSample &sample) const {
+        for (int attempt = 0; attempt < READ_ATTEMPTS; attempt++) {
+            uint64_t before = block->sequence.load(std::memory_order_acquire);
+            sample.time_ns = block->time_ns.load(std::memory_order_relaxed);
+            sample.frames = block->frames.load(std::memory_order_relaxed);
+            sample.busy_ns = block->busy_ns.load(std::memory_order_relaxed);
+            sample.instructions = block->instructions.load(std::memory_order_relaxed);
+            sample.cycles = block->cycles.load(std::memory_order_relaxed);
+            sample.idle_cycles = block->idle_cycles.load(std::memory_order_relaxed);
+            sample.audio_underruns = block->audio_underruns.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (!(before & 1) && block->sequence.load(std::memory_order_relaxed) == before) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+#endif //RGB_UTIL_LIVE_STATS_HPP
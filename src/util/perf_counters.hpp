@@ -0,0 +1,290 @@
+#ifndef RGB_UTIL_PERF_COUNTERS_HPP
+#define RGB_UTIL_PERF_COUNTERS_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware performance counters for the calling thread, through Linux's
+// perf_event_open, counting user space only. Every event is optional: a
+// CPU, VM or perf_event_paranoid setting that doesn't allow one leaves it
+// unavailable and the rest still count. Elsewhere nothing is available.
+//
+// The events are opened as one group so a read() is a single syscall and
+// the counts cover the same interval. If the kernel has to multiplex the
+// group with other users of the PMU, counts are scaled up by the share
+// of time it was running.
+
+class PerfCounters {
+  public:
+    enum Event { CYCLES, INSTRUCTIONS, BRANCH_MISSES, L1D_MISSES, LLC_MISSES, TASK_CLOCK, EVENTS };
+
+    static const char *name(int event) {
+        static const char *const names[EVENTS] = {
+            "cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses", "task_clock_ns"
+        };
+        return names[event];
+    }
+
+    // Counts since the group was opened, indexed by Event; zero for
+    // unavailable events
+    struct Sample {
+        uint64_t values[EVENTS] = {};
+
+        Sample operator-(const Sample &other) const {
+            Sample result;
+            for (int i = 0; i < EVENTS; i++) {
+                result.values[i] = values[i] - other.values[i];
+            }
+            return result;
+        }
+
+        Sample &operator+=(const Sample &other) {
+            for (int i = 0; i < EVENTS; i++) {
+                values[i] += other.values[i];
+            }
+            return *this;
+        }
+    };
+
+    PerfCounters() {
+        std::fill(fds, fds + EVENTS, -1);
+        std::fill(slots, slots + EVENTS, -1);
+#if defined(__linux__)
+        for (int event = 0; event < EVENTS; event++) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            switch (event) {
+            case CYCLES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case INSTRUCTIONS:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case BRANCH_MISSES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+            case L1D_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8
+                    | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+                break;
+            case LLC_MISSES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CACHE_MISSES;
+                break;
+            default:
+                attr.type = PERF_TYPE_SOFTWARE;
+                attr.config = PERF_COUNT_SW_TASK_CLOCK;
+                break;
+            }
+            // The first event that opens leads the group
+            int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader(), 0));
+            if (fd >= 0) {
+                fds[event] = fd;
+                slots[event] = opened++;
+            }
+        }
+#endif
+    }
+
+    ~PerfCounters() {
+#if defined(__linux__)
+        for (int fd : fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    bool available(int event) const {
+        return fds[event] >= 0;
+    }
+
+    bool any() const {
+        return opened > 0;
+    }
+
+    // Names of the events that couldn't be opened, comma separated
+    std::string missing() const {
+        std::string names;
+        for (int event = 0; event < EVENTS; event++) {
+            if (!available(event)) {
+                names += (names.empty() ? "" : ", ") + std::string(name(event));
+            }
+        }
+        return names;
+    }
+
+    Sample read() const {
+        Sample sample;
+#if defined(__linux__)
+        // nr, time enabled, time running, then one value per open event
+        uint64_t data[3 + EVENTS];
+        if (opened == 0 || ::read(leader(), data, sizeof(data)) < static_cast<ssize_t>((3 + opened) * 8)) {
+            return sample;
+        }
+        uint64_t enabled = data[1], running = data[2];
+        for (int event = 0; event < EVENTS; event++) {
+            if (slots[event] >= 0) {
+                uint64_t value = data[3 + slots[event]];
+                if (running && running < enabled) {
+                    value = static_cast<uint64_t>(static_cast<double>(value) * enabled / running);
+                }
+                sample.values[event] = value;
+            }
+        }
+#endif
+        return sample;
+    }
+
+  private:
+    int fds[EVENTS];
+    // Position of each event's value in a group read
+    int slots[EVENTS];
+    int opened = 0;
+
+    int leader() const {
+        for (int fd : fds) {
+            if (fd >= 0) {
+                return fd;
+            }
+        }
+        return -1;
+    }
+};
+
+// Per-frame counts for the whole frame and the parts of it that can be
+// bracketed, written as one CSV row per emulated frame. Sections may
+// nest inside the frame but not in each other; what the frame spent
+// outside them is reported as "cpu": instruction dispatch and the memory
+// accesses interleaved with it.
+//
+// Each section entry and exit is a counter read, about a microsecond, so
+// the overhead is a few hundred microseconds per frame while profiling
+// and a null pointer check otherwise.
+class PerfProfiler {
+  public:
+    enum Section { RENDER, AUDIO, SECTIONS };
+
+    explicit PerfProfiler(std::ostream &_csv) : csv(_csv) {
+        static const char *const prefixes[] = { "frame_", "cpu_", "render_", "audio_" };
+        csv << "frame";
+        for (const char *prefix : prefixes) {
+            for (int event = 0; event < PerfCounters::EVENTS; event++) {
+                if (counters.available(event)) {
+                    csv << "," << prefix << PerfCounters::name(event);
+                }
+            }
+        }
+        csv << "\n";
+    }
+
+    const PerfCounters &events() const {
+        return counters;
+    }
+
+    void begin(Section section) {
+        starts[section] = counters.read();
+    }
+
+    void end(Section section) {
+        sections[section] += counters.read() - starts[section];
+    }
+
+    void begin_frame() {
+        frame_start = counters.read();
+        for (PerfCounters::Sample &section : sections) {
+            section = PerfCounters::Sample();
+        }
+    }
+
+    // Write the row for a frame begun with begin_frame()
+    void end_frame(uint64_t frame) {
+        PerfCounters::Sample rows[2 + SECTIONS];
+        rows[0] = counters.read() - frame_start;
+        rows[1] = rows[0];
+        for (int i = 0; i < SECTIONS; i++) {
+            rows[1] = rows[1] - sections[i];
+            rows[2 + i] = sections[i];
+        }
+        csv << frame;
+        for (int i = 0; i < 2 + SECTIONS; i++) {
+            totals[i] += rows[i];
+            for (int event = 0; event < PerfCounters::EVENTS; event++) {
+                if (counters.available(event)) {
+                    csv << "," << rows[i].values[event];
+                }
+            }
+        }
+        csv << "\n";
+        frames++;
+    }
+
+    // Mean counts per frame, one line per section
+    void summary(std::ostream &out) const {
+        static const char *const names[] = { "frame", "cpu", "render", "audio" };
+        out << frames << " frames profiled, means per frame:\n";
+        for (int i = 0; i < 2 + SECTIONS; i++) {
+            out << "  " << names[i] << ":";
+            for (int event = 0; event < PerfCounters::EVENTS; event++) {
+                if (counters.available(event)) {
+                    out << " " << PerfCounters::name(event) << " " << (frames ? totals[i].values[event] / frames : 0);
+                }
+            }
+            out << "\n";
+        }
+    }
+
+  private:
+    PerfCounters counters;
+    std::ostream &csv;
+    PerfCounters::Sample frame_start;
+    PerfCounters::Sample starts[SECTIONS];
+    PerfCounters::Sample sections[SECTIONS];
+    // Frame, cpu, then each section
+    PerfCounters::Sample totals[2 + SECTIONS];
+    uint64_t frames = 0;
+};
+
+// Counts its scope into a section; does nothing without a profiler
+class PerfScope {
+    PerfProfiler *profiler;
+    PerfProfiler::Section section;
+
+  public:
+    PerfScope(PerfProfiler *_profiler, PerfProfiler::Section _section) : profiler(_profiler), section(_section) {
+        if (profiler) {
+            profiler->begin(section);
+        }
+    }
+
+    ~PerfScope() {
+        if (profiler) {
+            profiler->end(section);
+        }
+    }
+
+    PerfScope(const PerfScope &) = delete;
+    PerfScope &operator=(const PerfScope &) = delete;
+};
+
+#endif //RGB_UTIL_PERF_COUNTERS_HPP
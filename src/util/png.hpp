@@ -0,0 +1,107 @@
+#ifndef RGB_UTIL_PNG_HPP
+#define RGB_UTIL_PNG_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Minimal PNG writer for debugging output: 8-bit RGB, no filtering, and
+// zlib "stored" blocks instead of compression, so there is no dependency
+// on zlib. Files are about as large as the raw pixels.
+
+inline uint32_t png_crc32(const uint8_t *data, size_t len, uint32_t crc = 0)
+{
+    // Built once, thread-safely, on first use
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t;
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            t[n] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+inline void png_put32(std::vector<uint8_t> &out, uint32_t value)
+{
+    out.push_back(static_cast<uint8_t>(value >> 24));
+    out.push_back(static_cast<uint8_t>(value >> 16));
+    out.push_back(static_cast<uint8_t>(value >> 8));
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+inline void png_chunk(std::vector<uint8_t> &out, const char *type, const std::vector<uint8_t> &data)
+{
+    png_put32(out, static_cast<uint32_t>(data.size()));
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    png_put32(out, png_crc32(out.data() + start, out.size() - start));
+}
+
+// pixels are packed 0xRRGGBBAA, as Framebuffer's RGBA8888 plane; alpha is
+// dropped. Returns false if the file couldn't be written.
+inline bool write_png(const std::string &path, const uint32_t *pixels, int width, int height)
+{
+    // Each row is a filter byte (0, none) and the RGB samples
+    std::vector<uint8_t> raw;
+    raw.reserve(static_cast<size_t>(height) * (width * 3 + 1));
+    for (int y = 0; y < height; y++) {
+        raw.push_back(0);
+        for (int x = 0; x < width; x++) {
+            uint32_t pixel = pixels[y * width + x];
+            raw.push_back(static_cast<uint8_t>(pixel >> 24));
+            raw.push_back(static_cast<uint8_t>(pixel >> 16));
+            raw.push_back(static_cast<uint8_t>(pixel >> 8));
+        }
+    }
+
+    // zlib stream of stored deflate blocks, at most 65535 bytes each
+    std::vector<uint8_t> zlib = { 0x78, 0x01 };
+    size_t offset = 0;
+    do {
+        size_t len = std::min<size_t>(raw.size() - offset, 0xffff);
+        bool last = offset + len == raw.size();
+        zlib.push_back(last ? 1 : 0);
+        zlib.push_back(static_cast<uint8_t>(len));
+        zlib.push_back(static_cast<uint8_t>(len >> 8));
+        zlib.push_back(static_cast<uint8_t>(~len));
+        zlib.push_back(static_cast<uint8_t>(~len >> 8));
+        zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + len);
+        offset += len;
+    } while (offset < raw.size());
+    uint32_t a = 1, b = 0;
+    for (uint8_t byte : raw) {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    png_put32(zlib, b << 16 | a);
+
+    std::vector<uint8_t> header;
+    png_put32(header, static_cast<uint32_t>(width));
+    png_put32(header, static_cast<uint32_t>(height));
+    header.insert(header.end(), { 8, 2, 0, 0, 0 });   // 8-bit RGB, no interlace
+
+    std::vector<uint8_t> file = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    png_chunk(file, "IHDR", header);
+    png_chunk(file, "IDAT", zlib);
+    png_chunk(file, "IEND", {});
+
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(file.data()), file.size());
+    return static_cast<bool>(out);
+}
+
+#endif //RGB_UTIL_PNG_HPP
@@ -0,0 +1,87 @@
+#ifndef RGB_UTIL_SPSC_QUEUE_HPP
+#define RGB_UTIL_SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Capacity must be a power of two.
+template <class T, size_t Capacity>
+class SpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    // Padding keeps the two indices on separate cache lines
+    T items[Capacity];
+    char pad0[64];
+    std::atomic<size_t> head{0};   // next slot to write, owned by the producer
+    char pad1[64];
+    std::atomic<size_t> tail{0};   // next slot to read, owned by the consumer
+    char pad2[64];
+
+  public:
+    bool push(const T &item)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        items[h & (Capacity - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = items[t & (Capacity - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Push as many of count items as fit; returns how many were pushed
+    size_t push(const T *src, size_t count)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t space = Capacity - (h - tail.load(std::memory_order_acquire));
+        count = count < space ? count : space;
+        for (size_t i = 0; i < count; i++) {
+            items[(h + i) & (Capacity - 1)] = src[i];
+        }
+        head.store(h + count, std::memory_order_release);
+        return count;
+    }
+
+    // Pop up to count items into dst; returns how many were popped
+    size_t pop(T *dst, size_t count)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t ready = head.load(std::memory_order_acquire) - t;
+        count = count < ready ? count : ready;
+        for (size_t i = 0; i < count; i++) {
+            dst[i] = items[(t + i) & (Capacity - 1)];
+        }
+        tail.store(t + count, std::memory_order_release);
+        return count;
+    }
+
+    // Approximate when called from a thread other than the consumer
+    size_t size() const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    static constexpr size_t capacity()
+    {
+        return Capacity;
+    }
+};
+
+#endif //RGB_UTIL_SPSC_QUEUE_HPP
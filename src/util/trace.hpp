@@ -0,0 +1,178 @@
+#ifndef RGB_UTIL_TRACE_HPP
+#define RGB_UTIL_TRACE_HPP
+
+#include <string>
+
+// Scoped timing in Chrome's trace event format, for chrome://tracing or
+// ui.perfetto.dev. Only built with -DRGB_TRACE (cmake -DRGB_TRACE=ON);
+// otherwise RGB_TRACE_SCOPE expands to nothing and trace_write() fails.
+//
+//   void render_scan() {
+//       RGB_TRACE_SCOPE("scanline");
+//       ...
+//   }
+//
+// Each thread appends to a fixed-size buffer of its own, so recording
+// takes two clock reads and no locks or allocation. Names must be string
+// literals. When a thread's buffer is full its later events are dropped.
+// RGB_TRACE_THREAD_NAME labels the calling thread in the viewer.
+
+#ifdef RGB_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct TraceEvent {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+};
+
+class TraceBuffer {
+  public:
+    static constexpr size_t CAPACITY = 1 << 20;
+
+    std::unique_ptr<TraceEvent[]> events = std::unique_ptr<TraceEvent[]>(new TraceEvent[CAPACITY]);
+    // Published with release so trace_write() can read while threads run
+    std::atomic<size_t> count{0};
+    std::atomic<uint64_t> dropped{0};
+    uint32_t thread_id;
+    const char *thread_name = nullptr;
+
+    explicit TraceBuffer(uint32_t id) : thread_id(id) {}
+
+    void add(const char *name, uint64_t start_ns, uint64_t duration_ns) {
+        size_t n = count.load(std::memory_order_relaxed);
+        if (n == CAPACITY) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        events[n] = TraceEvent { name, start_ns, duration_ns };
+        count.store(n + 1, std::memory_order_release);
+    }
+};
+
+// Buffers outlive their threads, so threads that exit (an audio callback
+// thread, a render pipeline) still show up in the trace
+struct TraceRegistry {
+    std::mutex lock;
+    std::vector<TraceBuffer *> buffers;
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+    static TraceRegistry &get() {
+        static TraceRegistry *registry = new TraceRegistry();
+        return *registry;
+    }
+};
+
+inline TraceBuffer &trace_buffer()
+{
+    thread_local TraceBuffer *buffer = nullptr;
+    if (!buffer) {
+        TraceRegistry &registry = TraceRegistry::get();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        buffer = new TraceBuffer(static_cast<uint32_t>(registry.buffers.size() + 1));
+        registry.buffers.push_back(buffer);
+    }
+    return *buffer;
+}
+
+inline uint64_t trace_now_ns()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - TraceRegistry::get().epoch).count());
+}
+
+class TraceScope {
+    const char *name;
+    uint64_t start;
+
+  public:
+    explicit TraceScope(const char *_name) : name(_name), start(trace_now_ns()) {}
+
+    ~TraceScope() {
+        trace_buffer().add(name, start, trace_now_ns() - start);
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+};
+
+#define RGB_TRACE_CONCAT_(a, b) a##b
+#define RGB_TRACE_CONCAT(a, b) RGB_TRACE_CONCAT_(a, b)
+#define RGB_TRACE_SCOPE(name) TraceScope RGB_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+// Label the calling thread's track; name must be a string literal
+#define RGB_TRACE_THREAD_NAME(name) (trace_buffer().thread_name = (name))
+
+// Trace timestamps are microseconds, with the nanoseconds as decimals
+inline void trace_put_us(std::ostream &out, uint64_t ns)
+{
+    char text[32];
+    std::snprintf(text, sizeof(text), "%llu.%03u", (unsigned long long) (ns / 1000), (unsigned) (ns % 1000));
+    out << text;
+}
+
+// Everything recorded so far, as complete ("X") events in microseconds
+inline bool trace_write(const std::string &path)
+{
+    TraceRegistry &registry = TraceRegistry::get();
+    std::vector<TraceBuffer *> buffers;
+    {
+        std::lock_guard<std::mutex> guard(registry.lock);
+        buffers = registry.buffers;
+    }
+
+    std::ofstream out(path);
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    bool first = true;
+    for (TraceBuffer *buffer : buffers) {
+        out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+            << buffer->thread_id << ",\"args\":{\"name\":\"";
+        if (buffer->thread_name) {
+            out << buffer->thread_name;
+        } else {
+            out << "thread " << buffer->thread_id;
+        }
+        out << "\"}}";
+        first = false;
+        size_t count = buffer->count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count; i++) {
+            const TraceEvent &event = buffer->events[i];
+            out << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->thread_id
+                << ",\"ts\":";
+            trace_put_us(out, event.start_ns);
+            out << ",\"dur\":";
+            trace_put_us(out, event.duration_ns);
+            out << "}";
+        }
+        uint64_t dropped = buffer->dropped.load(std::memory_order_relaxed);
+        if (dropped) {
+            out << ",\n{\"name\":\"events dropped\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":" << buffer->thread_id
+                << ",\"ts\":";
+            trace_put_us(out, trace_now_ns());
+            out << ",\"args\":{\"count\":" << dropped << "}}";
+        }
+    }
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
+
+#else
+
+#define RGB_TRACE_SCOPE(name) do {} while (0)
+#define RGB_TRACE_THREAD_NAME(name) do {} while (0)
+
+inline bool trace_write(const std::string &)
+{
+    return false;
+}
+
+#endif
+
+#endif //RGB_UTIL_TRACE_HPP
@@ -1,7 +1,13 @@
+#ifndef RGB_Z80_CPP
+#define RGB_Z80_CPP
+
 #include <iostream>
 #include <iomanip>
 #include <cstdint>
+#include <string>
 #include "mmu.hpp"
+#include "opcodes.cpp"
+#include "util/hash.hpp"
 
 enum class Flags: uint8_t {
     Zero = 0x80,
@@ -45,7 +51,7 @@ int16_t decode_2c(uint8_t byte)
     int16_t ret;
     if (byte > 127) {
         // Decode 2's complement negative
-        ret = -(~byte+1);
+        ret = -static_cast<uint8_t>(~byte + 1);
     } else {
         ret = byte;
     }
@@ -89,9 +95,18 @@ class Registers {
 
     uint16_t de()
     {
-        uint16_t addr = ((uint16_t) b) << 8 | c;
+        uint16_t addr = ((uint16_t) d) << 8 | e;
         return addr;
     }
+
+    uint64_t hash() const
+    {
+        uint64_t lo = (uint64_t) a | (uint64_t) b << 8 | (uint64_t) c << 16 | (uint64_t) d << 24
+            | (uint64_t) e << 32 | (uint64_t) h << 40 | (uint64_t) l << 48 | (uint64_t) f << 56;
+        uint64_t hi = (uint64_t) pc | (uint64_t) sp << 16 | (uint64_t) ime << 32
+            | (uint64_t) i << 40 | (uint64_t) r << 48;
+        return hash_mix(hash_mix(lo) ^ hi);
+    }
 };
 
 class Z80 {
@@ -99,11 +114,35 @@ class Z80 {
     Clock clock;
     Registers reg;
     MMU &mmu;
-    Z80(MMU &_mmu) : mmu(_mmu) {}
+    Z80(MMU &_mmu) : mmu(_mmu) {
+        reset();
+    }
 
     bool halt;
     bool stop;
 
+    // Called when IME is set or the CPU halts, so the interrupt controller
+    // can re-check what is pending
+    using InterruptHook = void (*)(void *context);
+    InterruptHook interrupt_hook = nullptr;
+    void *interrupt_context = nullptr;
+
+    void notify_interrupts()
+    {
+        if (interrupt_hook) {
+            interrupt_hook(interrupt_context);
+        }
+    }
+
+    // Enter an interrupt handler: IME off, push PC, jump to the vector
+    void interrupt(uint16_t vector)
+    {
+        reg.ime = 0;
+        reg.sp -= 2;
+        mmu.ww(reg.sp, reg.pc);
+        reg.pc = vector;
+    }
+
     void reset()
     {
         reg.a = reg.b = reg.c = reg.d = reg.e = reg.h = reg.l = reg.m = reg.t = reg.i = reg.r = 0;
@@ -115,13 +154,37 @@ class Z80 {
         stop = false;
     }
 
+    // Registers as the boot ROM leaves them when it jumps to the cartridge
+    // at 0x0100, for starting without running it
+    void post_boot(bool cgb)
+    {
+        reset();
+        if (cgb) {
+            reg.a = 0x11;
+            reg.f = Flags::Zero;
+            reg.d = 0xff;
+            reg.e = 0x56;
+            reg.l = 0x0d;
+        } else {
+            reg.a = 0x01;
+            reg.f = Flags::Zero | Flags::HalfCarry | Flags::Carry;
+            reg.c = 0x13;
+            reg.e = 0xd8;
+            reg.h = 0x01;
+            reg.l = 0x4d;
+        }
+        reg.ime = 0;
+        reg.pc = 0x0100;
+        reg.sp = 0xfffe;
+    }
+
     void exec()
     {
         reg.r = (reg.r + 1) & 0x7f;
         uint8_t op = mmu.rb(reg.pc++);
         dispatch_op(op);
         clock.m += reg.m;
-        clock.t += clock.t;
+        clock.t += reg.t;
         if (mmu.inbios && reg.pc == 0x0100) {
             mmu.inbios = false;
         }
@@ -147,7 +210,7 @@ class Z80 {
         case 0x0e: LD_r_n(reg.c); break;
         case 0x0f: RRC_A(); break;
 
-        case 0x10: DJNZn(); break;
+        case 0x10: STOP(); break;
         case 0x11: LD_DE_nn(); break;
         case 0x12: LD_DEm_A(); break;
         case 0x13: INC_DE(); break;
@@ -382,7 +445,7 @@ class Z80 {
         case 0xeb: panic(); break;
         case 0xec: panic(); break;
         case 0xed: panic(); break;
-        case 0xee: OR_n(); break;
+        case 0xee: XOR_n(); break;
         case 0xef: RST(0x28); break;
 
         case 0xf0: LD_A_IOn(); break;
@@ -391,7 +454,7 @@ class Z80 {
         case 0xf3: DI(); break;
         case 0xf4: panic(); break;
         case 0xf5: PUSH(reg.a, (uint8_t &) reg.f); break;
-        case 0xf6: XOR_n(); break;
+        case 0xf6: OR_n(); break;
         case 0xf7: RST(0x30); break;
         case 0xf8: LD_HL_SPn(); break;
         case 0xf9: panic(); break;
@@ -546,8 +609,8 @@ class Z80 {
         case 0x7f: BIT_r(reg.a, 7); break;
 
         default: std::cerr
-            << "Bad extended instruction at address "
-            << reg.pc-1
+            << "Bad extended instruction " << disassemble_at(reg.pc - 2)
+            << " at address " << reg.pc - 2
             << "\n";
             stop = true;
         }
@@ -809,6 +872,8 @@ class Z80 {
         value += reg.sp;
         reg.h = value >> 8;
         reg.l = value & 0xff;
+        reg.m = 3;
+        reg.t = 12;
     }
 
     void SWAP_r(uint8_t &r)
@@ -1521,8 +1586,8 @@ class Z80 {
     {
         int16_t value = decode_2c(mmu.rb(reg.pc));
         reg.pc += value + 1;
-        reg.m += 3;
-        reg.t += 12;
+        reg.m = 3;
+        reg.t = 12;
     }
 
     void JRNZn()
@@ -1534,8 +1599,8 @@ class Z80 {
         } else {
             int16_t value = decode_2c(mmu.rb(reg.pc));
             reg.pc += value + 1;
-            reg.m += 3;
-            reg.t += 12;
+            reg.m = 3;
+            reg.t = 12;
         }
     }
 
@@ -1544,8 +1609,8 @@ class Z80 {
         if (reg.has_flags(Flags::Zero)) {
             int16_t value = decode_2c(mmu.rb(reg.pc));
             reg.pc += value + 1;
-            reg.m += 3;
-            reg.t += 12;
+            reg.m = 3;
+            reg.t = 12;
         } else {
             reg.pc++;
             reg.m = 2;
@@ -1562,8 +1627,8 @@ class Z80 {
         } else {
             int16_t value = decode_2c(mmu.rb(reg.pc));
             reg.pc += value + 1;
-            reg.m += 3;
-            reg.t += 12;
+            reg.m = 3;
+            reg.t = 12;
         }
     }
 
@@ -1572,8 +1637,8 @@ class Z80 {
         if (reg.has_flags(Flags::Carry)) {
             int16_t value = decode_2c(mmu.rb(reg.pc));
             reg.pc += value + 1;
-            reg.m += 3;
-            reg.t += 12;
+            reg.m = 3;
+            reg.t = 12;
         } else {
             reg.pc++;
             reg.m = 2;
@@ -1581,18 +1646,14 @@ class Z80 {
         }
     }
 
-    void DJNZn()
+    // Only the CGB speed switch is supported; otherwise emulation ends
+    void STOP()
     {
-        reg.b--;
-        if (reg.b) {
-            int16_t value = decode_2c(mmu.rb(reg.pc));
-            reg.pc += value + 1;
-            reg.m = 3;
-            reg.t = 12;
-        } else {
-            reg.pc++;
-            reg.m = 2;
-            reg.t = 8;
+        reg.pc++;
+        reg.m = 1;
+        reg.t = 4;
+        if (!mmu.switch_speed()) {
+            stop = true;
         }
     }
 
@@ -1655,6 +1716,7 @@ class Z80 {
         reg.sp += 2;
         reg.m = 3;
         reg.t = 12;
+        notify_interrupts();
     }
 
     void RET_cond(bool cond) {
@@ -1700,8 +1762,8 @@ class Z80 {
 
     void NOP()
     {
-        clock.m = 1;
-        clock.t = 4;
+        reg.m = 1;
+        reg.t = 4;
     }
 
     void HALT()
@@ -1709,6 +1771,7 @@ class Z80 {
         halt = true;
         reg.m = 1;
         reg.t = 4;
+        notify_interrupts();
     }
 
     void DI()
@@ -1723,13 +1786,25 @@ class Z80 {
         reg.ime = 1;
         reg.m = 1;
         reg.t = 4;
+        notify_interrupts();
     }
 
     void panic()
     {
-        std::cerr << "Unknown instruction at address " << reg.pc-1 << "\n";
+        std::cerr << "Unknown instruction " << disassemble_at(reg.pc - 1)
+                  << " at address " << reg.pc - 1 << "\n";
         stop = true;
     }
+
+    // The instruction at addr as text, for diagnostics
+    std::string disassemble_at(uint16_t addr)
+    {
+        uint8_t bytes[3];
+        for (int i = 0; i < 3; i++) {
+            bytes[i] = mmu.rb(static_cast<uint16_t>(addr + i));
+        }
+        return disassemble(bytes, addr);
+    }
 // }
 
     void dump_state(std::ostream &out)
@@ -1752,4 +1827,6 @@ class Z80 {
 
         out << "\n";
     }
-};
\ No newline at end of file
+};
+
+#endif //RGB_Z80_CPP